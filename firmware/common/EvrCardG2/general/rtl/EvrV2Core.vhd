@@ -5,7 +5,7 @@
 -- Author     : Matt Weaver <weaver@slac.stanford.edu>
 -- Company    : SLAC National Accelerator Laboratory
 -- Created    : 2016-01-04
--- Last update: 2023-09-28
+-- Last update: 2026-10-17
 -- Platform   : 
 -- Standard   : VHDL'93/02
 -------------------------------------------------------------------------------
@@ -249,7 +249,9 @@ begin  -- rtl
   U_Reg : entity work.EvrV2Reg
     generic map ( TPD_G             => TPD_G,
                   DMA_ENABLE_G      => true,
-                  DMA_FULL_WIDTH_G  => dmaFullThr'length )
+                  DMA_FULL_WIDTH_G  => dmaFullThr'length,
+                  CHANNELS_G        => NCHANNELS_C,
+                  TRIGGERS_G        => NTRIGGERS_C )
     port map (    axiClk              => axiClk,
                   axiRst              => axiRst,
                   axilWriteMaster     => mAxiWriteMasters0 (CSR_INDEX_C),
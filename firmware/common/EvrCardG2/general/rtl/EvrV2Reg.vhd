@@ -5,7 +5,7 @@
 -- Author     : Matt Weaver <weaver@slac.stanford.edu>
 -- Company    : SLAC National Accelerator Laboratory
 -- Created    : 2016-01-04
--- Last update: 2023-09-27
+-- Last update: 2026-10-17
 -- Platform   : 
 -- Standard   : VHDL'93/02
 -------------------------------------------------------------------------------
@@ -41,7 +41,9 @@ entity EvrV2Reg is
   generic (
     TPD_G            : time    := 1 ns;
     DMA_ENABLE_G     : boolean := false;
-    DMA_FULL_WIDTH_G : integer := 24);
+    DMA_FULL_WIDTH_G : integer := 24;
+    CHANNELS_G       : natural := 0;    -- reported in the resources register
+    TRIGGERS_G       : natural := 0);
   port (
     -- AXI-Lite and IRQ Interface
     axiClk              : in  sl;
@@ -66,6 +68,9 @@ end EvrV2Reg;
 
 architecture mapping of EvrV2Reg is
 
+  -- read-only resources register: channels in 7:0, triggers in 15:8
+  constant RESOURCES_C : slv(15 downto 0) := toSlv(TRIGGERS_G,8) & toSlv(CHANNELS_G,8);
+
   type RegType is record
     axilReadSlave  : AxiLiteReadSlaveType;
     axilWriteSlave : AxiLiteWriteSlaveType;
@@ -119,6 +124,7 @@ begin  -- mapping
       axiSlaveRegisterR(ep, X"00C", 0, dmaCount);
       axiSlaveRegister (ep, X"018", 0, v.dmaFullThr);
       axiSlaveRegisterR(ep, X"01C", 0, dmaDrops);
+      axiSlaveRegisterR(ep, X"020", 0, RESOURCES_C);
     end if;
     
     axiSlaveDefault(ep, v.axilWriteSlave, v.axilReadSlave, AXI_RESP_OK_C);
@@ -35,6 +35,16 @@ void TprCsr::enableRefClk(bool enable) {
     countReset = v & ~(1<<1);
 }
 
+unsigned TprCsr::nchannels() const {
+  unsigned n = resources&0xff;
+  return (n && n <= TprBase::MAXCHANNELS) ? n : 14;
+}
+
+unsigned TprCsr::ntriggers() const {
+  unsigned n = (resources>>8)&0xff;
+  return (n && n <= TprBase::MAXTRIGGERS) ? n : 12;
+}
+
 void TprCsr::dump() const {
   printf("irqEnable [%p]: %08x\n",&irqEnable,irqEnable);
   printf("irqStatus [%p]: %08x\n",&irqStatus,irqStatus);
@@ -43,6 +53,7 @@ void TprCsr::dump() const {
   printf("trigSel   [%p]: %08x\n",&trigMaster,trigMaster);
   printf("dmaFullThr[%p]: %08x\n",&dmaFullThr,dmaFullThr);
   printf("dmaDrops  [%p]: %08x\n",&dmaDrops  ,dmaDrops);
+  printf("resources [%p]: %08x (%u channels, %u triggers)\n",&resources,resources,nchannels(),ntriggers());
 }
 
 void ClockManager::dump() const
@@ -143,23 +154,21 @@ void ClockManager::clkSel(bool lcls2)
     *(reinterpret_cast<uint32_t*>(this)+drp[i][0]) = drp[i][lcls2?2:1];
 }
 
-void TrgMon::dump() const {
+void TrgMon::dump(unsigned ntriggers) const {
     const double clkR = 125.0e-3;
     printf("%8.8s %8.8s %8.8s %8.8s\n", "Chan", "MinDelns", "MaxDelns","Sumns");
-    for(unsigned i=0; i<TrgMon::NTRIGGERS; i++)
+    for(unsigned i=0; i<ntriggers && i<MAXTRIGGERS; i++)
         printf("%8u %8.0f %8.0f %8.0f\n",i,
                double(trigger[i].periodMin)/clkR,
                double(trigger[i].periodMax)/clkR,
                double(trigger[i].periodMin+trigger[i].periodMax)/clkR);
 }    
 
-void TprBase::dump() const {
-  static const unsigned NChan=14;
-  static const unsigned NTrig=12;
+void TprBase::dump(unsigned nchannels, unsigned ntriggers) const {
   printf("\nchannel0  [%p]\n",&channel[0].control);
 #define CHAN_REG(reg) {                                                 \
     printf("%s: ",#reg);                                                \
-    for(unsigned i=0; i<NChan; i++)    printf("%08x ",channel[i].reg);  \
+    for(unsigned i=0; i<nchannels; i++) printf("%08x ",channel[i].reg);  \
     printf("\n"); }
   CHAN_REG(control);
   CHAN_REG(evtCount);
@@ -171,7 +180,7 @@ void TprBase::dump() const {
   printf("\ntrigger0  [%p]\n",&trigger[0].control);
 #define TRIG_REG(reg) {                                                 \
     printf("%s: ",#reg);                                                \
-    for(unsigned i=0; i<NTrig; i++)    printf("%08x ",trigger[i].reg);  \
+    for(unsigned i=0; i<ntriggers; i++) printf("%08x ",trigger[i].reg);  \
     printf("\n"); }
   TRIG_REG(control);
   TRIG_REG(delay);
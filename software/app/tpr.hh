@@ -80,6 +80,9 @@ namespace Tpr {
     void setupDma    (unsigned fullThr=0x3f2);
     void enableRefClk(bool);
     void dump        () const;
+    //  From the resources register; firmware without it has 14 and 12
+    unsigned nchannels() const;
+    unsigned ntriggers() const;
   public:
     volatile uint32_t irqEnable;
     volatile uint32_t irqStatus;
@@ -89,6 +92,7 @@ namespace Tpr {
     volatile uint32_t trigMaster;
     volatile uint32_t dmaFullThr;
     volatile uint32_t dmaDrops;
+    volatile uint32_t resources;  // 7:0 channels, 15:8 triggers (0 on older firmware)
   };
 
   class ClockManager {
@@ -143,28 +147,28 @@ namespace Tpr {
 
   class TrgMon {
   public:
-    enum { NTRIGGERS=12 };
+    enum { MAXTRIGGERS=32 };
   public:
-    void dump() const;
+    void dump(unsigned ntriggers) const;
   public:
     volatile uint32_t reset;
     volatile uint32_t reserved;
     struct {
       volatile uint32_t periodMin;
       volatile uint32_t periodMax;
-    } trigger[NTRIGGERS];
+    } trigger[MAXTRIGGERS];
   };
   
   class TprBase {
   public:
-    enum { NCHANNELS=14 };
-    enum { NTRIGGERS=12 };
+    enum { MAXCHANNELS=32 };  // register space; the firmware's counts are in TprCsr
+    enum { MAXTRIGGERS=32 };
     enum Destination { Any };
     enum FixedRate { _1M, _71K, _10K, _1K, _100H, _10H, _1H };
     enum ACRate    { _60HA, _30HA, _10HA, _5HA, _1HA, _0_5HA };
     enum EventCode { _0, _1 };
   public:
-    void dump() const;
+    void dump(unsigned nchannels, unsigned ntriggers) const;
     void setupDma    (unsigned fullThr=0x3f2);
     void setupDaq    (unsigned i,
                       unsigned partition);
@@ -202,20 +206,14 @@ namespace Tpr {
       volatile uint32_t bsaCount; // not implemented
       volatile uint32_t bsaData;  // not implemented
       volatile uint32_t reserved[0x3f9];
-    } channel[NCHANNELS];
-    volatile uint32_t reserved_20[2];
-    volatile uint32_t frameCount;
-    volatile uint32_t reserved_2C[2];
-    volatile uint32_t bsaCntlCount; // not implemented
-    volatile uint32_t bsaCntlData;  // not implemented
-    volatile uint32_t reserved_b[0x3f9+0x400*(31-NCHANNELS)];
+    } channel[MAXCHANNELS];   // the frame counter follows the last one
     struct {
       volatile uint32_t control; // input, polarity, enabled
       volatile uint32_t delay;
       volatile uint32_t width;
       volatile uint32_t delayTap;
       volatile uint32_t reserved[0x3fc];
-    } trigger[NTRIGGERS];
+    } trigger[MAXTRIGGERS];
   };
 
   class DmaControl {
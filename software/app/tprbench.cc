@@ -0,0 +1,402 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'SLAC EVR Gen2', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Runs the driver's dma demux core (kernel/tpr_demux.h) over synthetic rx
+//  buffers laid out like the firmware's EvrV2EventDma / EvrV2BsaChannel /
+//  EvrV2BsaControl output, and reports its throughput.  Afterwards the
+//  queues are checked against what was fed, so it doubles as a regression
+//  test of the hot path.  No card needed.
+//
+//  Each channel's consumer is then timed over the newest allq window, through
+//  the allrp index or (-x, index_free) by scanning the tag words, and both
+//  sides are scaled to a message rate (-f) as the share of a core they need.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tpr_demux.h"
+#include "tprscan.hh"
+
+#include <vector>
+
+extern int optind;
+
+static void usage(const char* p) {
+  printf("Usage: %s [options]\n",p);
+  printf("          -n <chan> : channels of the firmware (default 14)\n");
+  printf("          -c <mask> : channel mask of each event (default 0x1)\n");
+  printf("          -b <n>    : every nth message is BSA (0=none, default 8)\n");
+  printf("          -a <bits> : BSA arrays touched per BSA message (default 4)\n");
+  printf("          -s <size> : rx buffer size [bytes] (default 4096)\n");
+  printf("          -r <bufs> : rx buffers in the ring (default 1023)\n");
+  printf("          -i <n>    : passes over the ring (default 1000)\n");
+  printf("          -q <n>    : allq depth (default 32768), bsaq gets a quarter\n");
+  printf("          -d <n>    : flag a firmware drop every nth buffer (0=none)\n");
+  printf("          -z        : publish zero-copy descriptors instead of entries\n");
+  printf("          -k        : also fill the compact ring\n");
+  printf("          -x        : index-free: tag words in place of the channel indices\n");
+  printf("          -f <Hz>   : message rate to scale the costs to (default 929000)\n");
+}
+
+//  Hooks of the demux core: zero-copy descriptors go to zcq/zcbsaq, the
+//  channel copy queues and filters of the driver are left out.
+struct bench {
+  struct tpr_demux  d;
+  struct TprZcDesc* zcq;
+  struct TprZcDesc* zcbsaq;
+  unsigned          buf;      // index of the buffer being parsed
+  uint64_t          indexed;
+  uint64_t          errors;
+};
+
+static inline void tpr_demux_zc(struct tpr_demux* d, int bsa, long long pos,
+                                __u32* dptr, __u64 tsc, void* buf)
+{
+  bench* b = reinterpret_cast<bench*>(d);
+  TprZcDesc* desc = bsa ? &b->zcbsaq[pos & d->bsaqMask] : &b->zcq[pos & d->allqMask];
+  WRITE_ONCE(desc->seq, TPR_SEQ_BUSY);
+  smp_wmb();
+  desc->buf      = buf ? b->buf : ~0U;
+  desc->offset   = buf ? reinterpret_cast<char*>(dptr) - reinterpret_cast<char*>(buf) : 0;
+  desc->tag      = dptr[0];
+  desc->epoch    = b->buf;
+  desc->fifo_tsc = tsc;
+  smp_store_release(&desc->seq, pos);
+}
+
+static inline void tpr_demux_indexed(struct tpr_demux* d, unsigned ich, long long pos,
+                                     __u32* dptr, size_t sz, __u64 tsc)
+{
+  reinterpret_cast<bench*>(d)->indexed++;
+}
+
+static inline void tpr_demux_message(struct tpr_demux* d, long long pos, __u32* dptr, void* buf)
+{
+}
+
+static inline void tpr_demux_error(struct tpr_demux* d, int why, __u32* dptr, void* buf)
+{
+  reinterpret_cast<bench*>(d)->errors++;
+}
+
+//  Firmware message layouts
+static unsigned put_event(uint32_t* p, uint32_t chmask, uint64_t pid)
+{
+  p[0] = (EVENT_TAG<<16) | chmask;
+  p[1] = (EVENT_MSGSZ-8)>>2;
+  for(unsigned i=2; i<EVENT_MSGSZ/4; i++)
+    p[i] = i;
+  p[EVENT_PULSEID_WORD  ] = pid & 0xffffffff;
+  p[EVENT_PULSEID_WORD+1] = pid >> 32;
+  p[EVENT_BEAMREQ_WORD  ] = 1 | ((pid&0xf)<<4);
+  return EVENT_MSGSZ/4;
+}
+
+static void put_mask(uint32_t* p, uint64_t m) { p[0] = m & 0xffffffff; p[1] = m >> 32; }
+
+static unsigned put_bsa(uint32_t* p, uint64_t pid, uint64_t arrays, bool control)
+{
+  if (control) {                         // EvrV2BsaControl
+    p[0] = BSACNTL_TAG<<16;
+    put_mask(&p[1], pid);
+    put_mask(&p[3], pid);                // timestamp
+    put_mask(&p[BSACNTL_INIT_WORD], arrays);
+    put_mask(&p[7], arrays);             // active
+    put_mask(&p[9], 0);                  // avgDone
+    return BSACNTL_MSGSZ/4;
+  }
+  p[0] = (BSAEVNT_TAG<<16) | 1;          // EvrV2BsaChannel
+  put_mask(&p[1], pid);
+  put_mask(&p[BSAEVNT_ACTIVE_WORD ], arrays);
+  put_mask(&p[BSAEVNT_AVGDONE_WORD], 0);
+  put_mask(&p[7], pid);                  // timestamp
+  put_mask(&p[BSAEVNT_DONE_WORD   ], arrays);
+  return BSAEVNT_MSGSZ/4;
+}
+
+static uint64_t now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+}
+
+static volatile uint64_t sink;
+
+//  Copy out channel ich's entries among the newest allqDepth positions, as
+//  a reader would: through its allrp index, or by scanning the tag words.
+static uint64_t consume(const tpr_demux& d, unsigned ich)
+{
+  long long depth = d.allqMask+1, gwp = d.tprq->gwp;
+  long long lo    = gwp > depth ? gwp - depth : 0;
+  uint64_t  n = 0, sum = 0;
+  TprEntry  e;
+
+  if (d.allmask) {
+    for(long long rp = lo; (rp = Tpr::tprScanTags(d.allmask, depth, rp, gwp, 1u<<ich)) < gwp; rp++) {
+      const TprEntry& src = d.allq[rp & d.allqMask];
+      if (src.seq != rp)
+        continue;
+      memcpy(&e, &src, sizeof(e));
+      sum += e.word[EVENT_PULSEID_WORD];
+      n++;
+    }
+  }
+  else {
+    long long wp = d.tprq->allwp[ich];
+    const long long* idx = d.allrp + size_t(ich)*depth;
+    for(long long rp = wp > depth ? wp - depth : 0; rp < wp; rp++) {
+      long long pos = idx[rp & d.allqMask];
+      const TprEntry& src = d.allq[pos & d.allqMask];
+      if (pos < lo || src.seq != pos)
+        continue;
+      memcpy(&e, &src, sizeof(e));
+      sum += e.word[EVENT_PULSEID_WORD];
+      n++;
+    }
+  }
+  sink = sink + sum;
+  return n;
+}
+
+int main(int argc, char** argv) {
+
+  extern char* optarg;
+  int c;
+  bool lUsage = false;
+
+  uint32_t chmask = 0x1;
+  unsigned nchan = 14;
+  unsigned bsaEvery = 8, bsaBits = 4, bufSize = 4096, nbufs = 1023, passes = 1000;
+  unsigned allqDepth = 32768, dropEvery = 0;
+  bool     lZc = false;
+  bool     lCompact = false;
+  bool     lIndexFree = false;
+  double   rate = 929000;
+
+  while ( (c=getopt( argc, argv, "n:c:b:a:s:r:i:q:d:zkxf:h?")) != EOF ) {
+    switch(c) {
+    case 'n': nchan     = strtoul(optarg,NULL,0); break;
+    case 'c': chmask    = strtoul(optarg,NULL,0); break;
+    case 'b': bsaEvery  = strtoul(optarg,NULL,0); break;
+    case 'a': bsaBits   = strtoul(optarg,NULL,0); break;
+    case 's': bufSize   = strtoul(optarg,NULL,0); break;
+    case 'r': nbufs     = strtoul(optarg,NULL,0); break;
+    case 'i': passes    = strtoul(optarg,NULL,0); break;
+    case 'q': allqDepth = strtoul(optarg,NULL,0); break;
+    case 'd': dropEvery = strtoul(optarg,NULL,0); break;
+    case 'z': lZc = true; break;
+    case 'k': lCompact = true; break;
+    case 'x': lIndexFree = true; break;
+    case 'f': rate      = strtod(optarg,NULL); break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    case '?':
+    default:
+      lUsage = true;
+      break;
+    }
+  }
+
+  if (optind < argc || !nchan || nchan > MAX_CHANNELS || (chmask >> nchan) || !nbufs || bufSize < EVENT_MSGSZ+4 || bsaBits > MOD_BSA ||
+      allqDepth < 16 || (allqDepth & (allqDepth-1)))
+    lUsage = true;
+
+  if (lUsage) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  //  Queues, laid out as separate arrays (the mapping is not under test)
+  unsigned bsaqDepth = allqDepth/4;
+  bench b;
+  memset(&b, 0, sizeof(b));
+  b.d.tprq     = new TprQueues();
+  memset(b.d.tprq, 0, sizeof(TprQueues));
+  b.d.allqMask = allqDepth-1;
+  b.d.bsaqMask = bsaqDepth-1;
+  if (lIndexFree)
+    b.d.allmask = new uint32_t[allqDepth]();
+  else
+    b.d.allrp   = new long long[size_t(nchan)*allqDepth];
+  b.d.bsarp    = new long long[size_t(MOD_BSA)*bsaqDepth];
+  b.d.chanMask = (1U<<nchan)-1;
+  b.d.minors   = chmask;
+  b.d.bsaOpen  = bsaEvery != 0;
+  b.d.zc       = lZc;
+  if (lZc) {
+    b.zcq    = new TprZcDesc[allqDepth];
+    b.zcbsaq = new TprZcDesc[bsaqDepth];
+  }
+  else {
+    b.d.allq = new TprEntry[allqDepth];
+    b.d.bsaq = new TprEntry[bsaqDepth];
+  }
+  if (lCompact)
+    b.d.compact = new TprCompact[allqDepth];
+
+  //  Fill the ring; each buffer holds as many messages as fit before END_TAG
+  std::vector<uint32_t> ring(size_t(nbufs)*bufSize/4);
+  uint64_t nevent=0, nbsa=0, ndrop=0, pid=0;
+  uint64_t perch[MAX_CHANNELS] = {0}, perarr[MOD_BSA] = {0};
+  unsigned seed = 1;
+  for(unsigned ib=0; ib<nbufs; ib++) {
+    uint32_t* p   = &ring[size_t(ib)*bufSize/4];
+    uint32_t* end = p + bufSize/4 - 1;
+    uint32_t* first = p;
+    for(unsigned im=0; ; im++) {
+      bool bsa = bsaEvery && (im % bsaEvery) == bsaEvery-1;
+      unsigned words = bsa ? BSAEVNT_MSGSZ/4 : EVENT_MSGSZ/4;
+      if (p + words > end)
+        break;
+      if (bsa) {
+        uint64_t arrays = 0;
+        while (unsigned(__builtin_popcountll(arrays)) < bsaBits)
+          arrays |= 1ULL << (rand_r(&seed) % MOD_BSA);
+        p += put_bsa(p, pid, arrays, (im/bsaEvery)%16 == 0);
+        for(unsigned ia=0; ia<MOD_BSA; ia++)
+          if (arrays & (1ULL<<ia)) perarr[ia]++;
+        nbsa++;
+      }
+      else {
+        p += put_event(p, chmask, pid++);
+        for(unsigned ich=0; ich<nchan; ich++)
+          if (chmask & (1<<ich)) perch[ich]++;
+        nevent++;
+      }
+    }
+    *p = END_TAG<<16;
+    if (dropEvery && (ib % dropEvery) == 0) {
+      *first |= 0x800<<20;
+      ndrop++;
+    }
+  }
+
+  uint64_t nmsgRing = nevent + nbsa;
+  printf("%u buffers of %u bytes: %llu events, %llu BSA messages, %llu drops per pass\n",
+         nbufs, bufSize, (unsigned long long)nevent, (unsigned long long)nbsa,
+         (unsigned long long)ndrop);
+
+  //  Run
+  uint64_t t0 = now_ns();
+  for(unsigned ip=0; ip<passes; ip++)
+    for(unsigned ib=0; ib<nbufs; ib++) {
+      unsigned nmsg;
+      b.buf = ib;
+      tpr_demux_buffer(&b.d, &ring[size_t(ib)*bufSize/4], &ring[size_t(ib)*bufSize/4], &nmsg);
+    }
+  uint64_t dt = now_ns() - t0;
+
+  uint64_t nmsg = nmsgRing*passes;
+  printf("%llu messages in %.3f s: %.2f Mmsg/s, %.2f ns/msg, %.2f ns/buffer\n",
+         (unsigned long long)nmsg, double(dt)*1.e-9,
+         double(nmsg)*1.e3/double(dt), double(dt)/double(nmsg),
+         double(dt)/(double(nbufs)*passes));
+
+  //  Check the queues against what was fed
+  const TprQueues& q = *b.d.tprq;
+  unsigned fail = 0;
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fail++; } } while(0)
+
+  uint64_t drops = ndrop*passes;
+  uint64_t nchdrop = drops * (chmask ? 1 : 0);
+  CHECK(b.d.dmaCount == nmsg, "dmaCount %llu != %llu", (unsigned long long)b.d.dmaCount, (unsigned long long)nmsg);
+  CHECK(b.d.dmaEvent == nevent*passes, "dmaEvent %llu", (unsigned long long)b.d.dmaEvent);
+  CHECK(b.d.dmaBsaChan + b.d.dmaBsaCtrl == nbsa*passes, "BSA messages %llu",
+        (unsigned long long)(b.d.dmaBsaChan + b.d.dmaBsaCtrl));
+  CHECK(b.errors == 0 && b.d.dmaErrors == 0, "%llu errors", (unsigned long long)b.errors);
+  CHECK(uint64_t(q.gwp) == nevent*passes + nchdrop, "gwp %lld", q.gwp);
+  CHECK(uint64_t(q.bsawp) == nbsa*passes + (bsaEvery ? drops : 0), "bsawp %lld", q.bsawp);
+  for(unsigned ich=0; ich<nchan; ich++) {   // index-free keeps no channel write pointers or entry counts
+    uint64_t expect = lIndexFree ? 0 : perch[ich]*passes + ((chmask & (1<<ich)) ? drops : 0);
+    CHECK(uint64_t(q.allwp[ich]) == expect, "allwp[%u] %lld != %llu", ich, q.allwp[ich], (unsigned long long)expect);
+    expect = lIndexFree ? 0 : perch[ich]*passes;
+    CHECK(uint64_t(q.chstat[ich].entries) == expect, "chstat[%u].entries %lld", ich, q.chstat[ich].entries);
+    expect = (chmask & (1<<ich)) ? drops : 0;
+    CHECK(uint64_t(q.chstat[ich].drops) == expect, "chstat[%u].drops %lld", ich, q.chstat[ich].drops);
+  }
+  for(unsigned ia=0; ia<MOD_BSA; ia++) {
+    uint64_t expect = perarr[ia]*passes + (bsaEvery ? drops : 0);
+    CHECK(uint64_t(q.bsaiwp[ia]) == expect, "bsaiwp[%u] %lld != %llu", ia, q.bsaiwp[ia], (unsigned long long)expect);
+  }
+
+  //  The newest entry of each indexed channel is the last message fed
+  for(unsigned ich=0; ich<nchan && q.gwp; ich++) {
+    if (!(chmask & (1<<ich)))
+      continue;
+    long long pos;
+    if (lIndexFree) {
+      pos = q.gwp-1;
+      CHECK(b.d.allmask[pos & b.d.allqMask] & (1<<ich), "allmask[%lld] %08x lacks channel %u",
+            pos, b.d.allmask[pos & b.d.allqMask], ich);
+    }
+    else {
+      pos = b.d.allrp[size_t(ich)*allqDepth + ((q.allwp[ich]-1) & b.d.allqMask)];
+      CHECK(pos == q.gwp-1, "allrp[%u] newest %lld != %lld", ich, pos, q.gwp-1);
+    }
+    if (!lZc) {
+      const TprEntry& e = b.d.allq[pos & b.d.allqMask];
+      CHECK(e.seq == pos, "allq seq %lld != %lld", (long long)e.seq, pos);
+      CHECK(((e.word[0]>>16)&0xf) == EVENT_TAG || ((e.word[0]>>16)&0xf) == DROP_TAG,
+            "allq tag %08x", e.word[0]);
+    }
+    else {
+      const TprZcDesc& z = b.zcq[pos & b.d.allqMask];
+      CHECK(z.seq == pos, "zcq seq %lld != %lld", (long long)z.seq, pos);
+    }
+    if (lCompact) {
+      const TprCompact& k = b.d.compact[pos & b.d.allqMask];
+      CHECK(k.seq == uint32_t(pos), "compact seq %08x != %08x", k.seq, uint32_t(pos));
+      CHECK(((k.tag>>16)&0xf) == DROP_TAG || k.pulseId == pid-1,
+            "compact pulseId %llu != %llu", (unsigned long long)k.pulseId, (unsigned long long)(pid-1));
+    }
+  }
+
+  //  Consumers, and what both sides cost at the message rate
+  if (!lZc) {
+    const unsigned reps = 20;
+    long long depth = allqDepth;
+    long long lo    = q.gwp > depth ? q.gwp - depth : 0;
+    double    posPerMsg = double(q.gwp)/double(nmsg);
+    printf("at %.0f Hz: demux %.1f%% of a core (%s)\n", rate,
+           double(dt)/double(nmsg)*rate*1.e-7, lIndexFree ? "index-free" : "indexed");
+    double total = 0;
+    for(unsigned ich=0; ich<nchan; ich++) {
+      if (!(chmask & (1<<ich)))
+        continue;
+      uint64_t n = 0, expect = 0;
+      uint64_t t1 = now_ns();
+      for(unsigned r=0; r<reps; r++)
+        n = consume(b.d, ich);
+      uint64_t ct = now_ns() - t1;
+      for(long long p=lo; p<q.gwp; p++) {
+        const TprEntry& e = b.d.allq[p & b.d.allqMask];
+        if (e.seq == p && (e.word[0] & (1<<ich)))
+          expect++;
+      }
+      CHECK(n == expect, "channel %u consumed %llu != %llu", ich,
+            (unsigned long long)n, (unsigned long long)expect);
+      double perPos = double(ct)/reps/double(q.gwp - lo);   // [ns] per allq position
+      total += perPos*posPerMsg*rate*1.e-7;
+      printf("channel %2u: %llu entries of %lld positions, %.2f ns/entry, %.1f%% of a core\n",
+             ich, (unsigned long long)n, q.gwp - lo, n ? double(ct)/reps/double(n) : 0.,
+             perPos*posPerMsg*rate*1.e-7);
+    }
+    printf("consumers %.1f%% of a core in all\n", total);
+  }
+
+  printf("%s\n", fail ? "FAIL" : "PASS");
+  return fail ? 1 : 0;
+}
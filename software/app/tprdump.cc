@@ -16,11 +16,14 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 
 #include "tpr.hh"
 #include "tprsh.hh"
 
 #include <string>
+#include <algorithm>
 
 using namespace Tpr;
 
@@ -29,13 +32,52 @@ extern int optind;
 static void usage(const char* p) {
   printf("Usage: %s [options]\n",p);
   printf("          -d <dev>  : <tpr a/b> [-c <channel>] [-v]\n");
+  printf("          -C        : read the channel's private copy queue\n");
+  printf("          -Z        : read the rx buffers in place (zero-copy)\n");
+  printf("          -R        : copy entries out with read() instead of mapping the queues\n");
+  printf("          -K        : read the compact ring (pulse id, timestamp, tag and tsc only)\n");
+  printf("          -e        : wait on an eventfd with epoll instead of read()\n");
+  printf("          -w <n,us> : coalesce wakeups to every n entries or us microseconds\n");
+  printf("          -f <n,m,p,d> : read through a filter: every nth, pulseId%%m==p, destination mask d\n");
 }
 
 static void frame_capture(char,unsigned);
+static void chnq_capture (char,unsigned);
+static void zc_capture   (char,unsigned);
+static void read_capture (char,unsigned);
+static void compact_capture(char,unsigned);
 static void dump_frame         (volatile const uint32_t*);
 static bool parse_frame        (volatile const uint32_t*, uint64_t&, uint64_t&);
 
 static bool verbose = false;
+static bool lEventfd = false;
+static tpr_coalesce coalesce = {0,0};
+static tpr_filter   filter = {0,0,0,0};
+static bool lFilter = false;
+
+//  Block until the channel has new entries
+static void wait_for_data(int fd)
+{
+    static int epfd = -1;
+    if (lEventfd) {
+        if (epfd < 0) {
+            int efd = eventfd(0, EFD_NONBLOCK);
+            if (ioctl(fd, TPR_IOC_EVENTFD, &efd) < 0)
+                perror("TPR_IOC_EVENTFD");
+            epfd = epoll_create1(0);
+            struct epoll_event ev;
+            ev.events  = EPOLLIN | EPOLLET;  // no need to read the counter
+            ev.data.fd = efd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+        }
+        struct epoll_event ev;
+        epoll_wait(epfd, &ev, 1, -1);
+    }
+    else {
+        uint32_t pending;
+        read(fd, &pending, sizeof(pending));
+    }
+}
 
 
 int main(int argc, char** argv) {
@@ -43,14 +85,48 @@ int main(int argc, char** argv) {
   extern char* optarg;
   char tprid='a';
   unsigned idx=0;
+  bool lChnq=false;
+  bool lZc=false;
+  bool lRead=false;
+  bool lCompact=false;
 
   int c;
   bool lUsage = false;
 
   char* endptr;
 
-  while ( (c=getopt( argc, argv, "c:d:vh?")) != EOF ) {
+  while ( (c=getopt( argc, argv, "c:d:CZRKew:f:vh?")) != EOF ) {
     switch(c) {
+    case 'C':
+      lChnq = true;
+      break;
+    case 'Z':
+      lZc = true;
+      break;
+    case 'R':
+      lRead = true;
+      break;
+    case 'K':
+      lCompact = true;
+      break;
+    case 'e':
+      lEventfd = true;
+      break;
+    case 'f':
+      lFilter = true;
+      filter.decimate = strtoul(optarg,&endptr,0);
+      if (*endptr==',')
+        filter.modulo = strtoul(endptr+1,&endptr,0);
+      if (*endptr==',')
+        filter.phase = strtoul(endptr+1,&endptr,0);
+      if (*endptr==',')
+        filter.destMask = strtoul(endptr+1,&endptr,0);
+      break;
+    case 'w':
+      coalesce.minEntries = strtoul(optarg,&endptr,0);
+      if (*endptr==',')
+        coalesce.maxDelayUs = strtoul(endptr+1,&endptr,0);
+      break;
     case 'c':
       idx = strtoul(optarg,0,NULL);
       break;
@@ -124,10 +200,19 @@ int main(int argc, char** argv) {
     printf("--core--\n");
     reg.tpr.dump();
     printf("--base--\n");
-    reg.base.dump();
+    reg.base.dump(reg.csr.nchannels(), reg.csr.ntriggers());
   }
 
-  frame_capture(tprid,idx);
+  if (lChnq)
+    chnq_capture(tprid,idx);
+  else if (lZc)
+    zc_capture(tprid,idx);
+  else if (lRead)
+    read_capture(tprid,idx);
+  else if (lCompact)
+    compact_capture(tprid,idx);
+  else
+    frame_capture(tprid,idx);
 
   return 0;
 }
@@ -144,24 +229,39 @@ void frame_capture(char tprid, unsigned idx)
         return;
     }
 
-    void* ptr = mmap(0, sizeof(TprQueues), PROT_READ, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) {
-        perror("Failed to map - FAIL");
+    size_t qsize;
+    const TprQueues* qp = tprMapQueues(fd, qsize);
+    if (!qp) {
+        printf("Failed to map - FAIL\n");
         return;
     }
 
+    if ((coalesce.minEntries || coalesce.maxDelayUs) &&
+        ioctl(fd, TPR_IOC_COALESCE, &coalesce) < 0)
+        perror("TPR_IOC_COALESCE");
+
+    const TprFiltQueue* filtq = 0;
+    size_t fsize = 0;
+    if (lFilter) {
+        if (ioctl(fd, TPR_IOC_FILTER, &filter) < 0)
+            perror("TPR_IOC_FILTER");
+        else
+            filtq = tprMapFilter(fd, qp->hdr, fsize);
+    }
+
     //  read the captured frames
 
     printf("   %16.16s %8.8s %8.8s\n",
            "PulseId","Seconds","Nanosec");
 
-    TprQueues& q = *(TprQueues*)ptr;
+    const TprQueues& q = *qp;
+    printf("queues on numa node %d\n", q.hdr.node);
 
     char* buff = new char[32];
 
-    int64_t allrp = q.allwp[idx];
-    int64_t bsarp = q.bsawp;
-    printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
+    TprReader reader = filtq ? TprReader(q, *filtq) : TprReader(q, idx);
+    TprEntry  entry;
+    printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) reader.position(), idx, (uint64_t) q.allwp[idx]);
 
     read(fd, buff, 32);
     //    read(fdbsa, buff, 32);
@@ -169,18 +269,26 @@ void frame_capture(char tprid, unsigned idx)
 
     uint64_t pulseIdP=0;
     uint64_t pulseId, timeStamp;
+    uint64_t tscLast=0;
     unsigned nframes=0;
+    //  Expected pulse id step (a destination filter makes it irregular)
+    uint64_t pstep = (filtq ? std::max(filter.decimate,1U)*std::max(filter.modulo,1U) : 1);
 
     do {
-        //        printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
-        while(allrp < q.allwp[idx] && nframes<10) {
-            volatile const uint32_t* p = reinterpret_cast<volatile const uint32_t*>
-                (&q.allq[q.allrp[idx].idx[allrp &(MAX_TPR_ALLQ-1)] &(MAX_TPR_ALLQ-1) ].word[0]);
+        TprReader::Result result;
+        while(nframes<10 && (result = reader.next(entry)) != TprReader::Empty) {
+            if (result == TprReader::Lapped) {
+                printf("lapped: %llu entries lost\n", reader.lost());
+                pulseIdP = 0;
+                continue;
+            }
+            volatile const uint32_t* p = &entry.word[0];
+            tscLast = entry.fifo_tsc;
             if (verbose)
                 dump_frame(p);
             else if (parse_frame(p, pulseId, timeStamp)) {
                 if (pulseIdP) {
-                    uint64_t pulseIdN = pulseIdP+1;
+                    uint64_t pulseIdN = pulseIdP+pstep;
                     //                    if (tmode==LCLS1) pulseIdN = (pulseId&~0x1ffffULL) | (pulseIdN&0x1ffffULL);
                     printf(" 0x%016llx %9u.%09u %s\n",
                            (unsigned long long)pulseId,
@@ -191,17 +299,362 @@ void frame_capture(char tprid, unsigned idx)
                 }
                 pulseIdP  =pulseId;
             }
+        }
+        if (nframes>=10)
+            break;
+        wait_for_data(fd);
+    } while(1);
+
+    printf("channel %u: entries %lld  drops %lld  dmaErrors %lld\n", idx,
+           q.chstat[idx].entries, q.chstat[idx].drops, q.chstat[idx].dmaErrors);
+
+    if (tscLast) {
+        uint64_t tai, mono = q.tsccal.monoNs(tscLast, &tai);
+        printf("last frame arrived at CLOCK_MONOTONIC %llu.%09llu  CLOCK_TAI %llu.%09llu\n",
+               (unsigned long long)(mono/1000000000ULL), (unsigned long long)(mono%1000000000ULL),
+               (unsigned long long)(tai /1000000000ULL), (unsigned long long)(tai %1000000000ULL));
+    }
+
+    if (filtq)
+        munmap((void*)filtq, fsize);
+    munmap((void*)qp, qsize);
+    close(fd);
+}
+
+void chnq_capture(char tprid, unsigned idx)
+{
+    char dev[16];
+    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
+
+    int fd = open(dev, O_RDONLY);
+    if (fd<0) {
+        printf("Open failure for dev %s [FAIL]\n",dev);
+        perror("Could not open");
+        return;
+    }
+
+    size_t qsize;
+    const TprQueues* qp = tprMapQueues(fd, qsize);
+    if (!qp) {
+        printf("Failed to map - FAIL\n");
+        return;
+    }
+    const TprQHeader hdr = qp->hdr;
+    munmap((void*)qp, qsize);
+
+    if (!hdr.chnqOffset) {
+        printf("No channel queues (driver loaded with chan_queues=1?) - FAIL\n");
+        return;
+    }
+
+    void* ptr = mmap(0, hdr.chnqSize, PROT_READ, MAP_SHARED, fd, hdr.chnqOffset);
+    if (ptr == MAP_FAILED) {
+        perror("Failed to map channel queue - FAIL");
+        return;
+    }
+
+    printf("   %16.16s %8.8s %8.8s\n",
+           "PulseId","Seconds","Nanosec");
+
+    TprChQueue& q = *(TprChQueue*)ptr;
+
+    char* buff = new char[32];
+
+    int64_t rp = q.chnwp;
+    printf("rp %#lx  q.chnwp %#lx\n", (uint64_t) rp, (uint64_t) q.chnwp);
+
+    read(fd, buff, 32);
+
+    uint64_t pulseIdP=0;
+    uint64_t pulseId, timeStamp;
+    unsigned nframes=0;
+
+    do {
+        while(rp < q.chnwp && nframes<10) {
+            volatile const uint32_t* p = &q.chnq(rp, hdr.chnqDepth).word[0];
+            if (verbose)
+                dump_frame(p);
+            else if (parse_frame(p, pulseId, timeStamp)) {
+                if (pulseIdP) {
+                    printf(" 0x%016llx %9u.%09u %s\n",
+                           (unsigned long long)pulseId,
+                           unsigned(timeStamp>>32),
+                           unsigned(timeStamp&0xffffffff),
+                           (pulseId==pulseIdP+1) ? "PASS":"FAIL");
+                    nframes++;
+                }
+                pulseIdP  =pulseId;
+            }
+            rp++;
+        }
+        if (nframes>=10)
+            break;
+        read(fd, buff, 32);
+    } while(1);
+
+    munmap(ptr, hdr.chnqSize);
+    close(fd);
+}
+
+void read_capture(char tprid, unsigned idx)
+{
+    char dev[16];
+    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
+
+    int fd = open(dev, O_RDONLY);
+    if (fd<0) {
+        printf("Open failure for dev %s [FAIL]\n",dev);
+        perror("Could not open");
+        return;
+    }
+
+    if ((coalesce.minEntries || coalesce.maxDelayUs) &&
+        ioctl(fd, TPR_IOC_COALESCE, &coalesce) < 0)
+        perror("TPR_IOC_COALESCE");
+
+    if (lFilter && ioctl(fd, TPR_IOC_FILTER, &filter) < 0)
+        perror("TPR_IOC_FILTER");
+
+    int mode = TPR_READ_ENTRIES;
+    if (ioctl(fd, TPR_IOC_READMODE, &mode) < 0) {
+        perror("TPR_IOC_READMODE - FAIL");
+        close(fd);
+        return;
+    }
+
+    printf("   %16.16s %8.8s %8.8s\n",
+           "PulseId","Seconds","Nanosec");
+
+    //  Room for a batch of entries and the trailer
+    const unsigned nbatch = 64;
+    size_t bsize = nbatch*sizeof(TprEntry) + sizeof(tpr_read_trailer);
+    char* buff = new char[bsize];
+
+    uint64_t pulseIdP=0;
+    uint64_t pulseId, timeStamp;
+    uint64_t lost=0;
+    unsigned nframes=0, nreads=0, nentries=0;
+    uint64_t pstep = (lFilter ? std::max(filter.decimate,1U)*std::max(filter.modulo,1U) : 1);
+    tpr_read_trailer tr = {};
+
+    while(nframes<10) {
+        ssize_t n = read(fd, buff, bsize);
+        if (n < ssize_t(sizeof(tr))) {
+            perror("read - FAIL");
+            break;
+        }
+        memcpy(&tr, buff + n - sizeof(tr), sizeof(tr));
+        nreads++;
+        nentries += tr.entries;
+        if (tr.lost != lost) {
+            printf("lapped: %llu entries lost\n", (unsigned long long)(tr.lost - lost));
+            lost = tr.lost;
+            pulseIdP = 0;
+        }
+        const TprEntry* e = reinterpret_cast<const TprEntry*>(buff);
+        for(unsigned i=0; i<tr.entries && nframes<10; i++) {
+            volatile const uint32_t* p = &e[i].word[0];
+            if (verbose)
+                dump_frame(p);
+            else if (parse_frame(p, pulseId, timeStamp)) {
+                if (pulseIdP) {
+                    printf(" 0x%016llx %9u.%09u %s\n",
+                           (unsigned long long)pulseId,
+                           unsigned(timeStamp>>32),
+                           unsigned(timeStamp&0xffffffff),
+                           (pulseId==pulseIdP+pstep) ? "PASS":"FAIL");
+                    nframes++;
+                }
+                pulseIdP  =pulseId;
+            }
+        }
+    }
+
+    printf("channel %u: %u entries in %u reads  rp %lld  wp %lld  lost %llu  drops %llu\n",
+           idx, nentries, nreads, (long long)tr.rp, (long long)tr.wp,
+           (unsigned long long)tr.lost, (unsigned long long)tr.drops);
+
+    delete[] buff;
+    close(fd);
+}
+
+void compact_capture(char tprid, unsigned idx)
+{
+    char dev[16];
+    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
+
+    int fd = open(dev, O_RDONLY);
+    if (fd<0) {
+        printf("Open failure for dev %s [FAIL]\n",dev);
+        perror("Could not open");
+        return;
+    }
+
+    size_t qsize;
+    const TprQueues* qp = tprMapQueues(fd, qsize);
+    if (!qp) {
+        printf("Failed to map - FAIL\n");
+        return;
+    }
+    const TprQueues& q = *qp;
+
+    const TprCompact* cq = tprMapCompact(fd, q.hdr);
+    if (!cq) {
+        printf("Failed to map compact ring - FAIL\n");
+        munmap((void*)qp, qsize);
+        return;
+    }
+
+    if ((coalesce.minEntries || coalesce.maxDelayUs) &&
+        ioctl(fd, TPR_IOC_COALESCE, &coalesce) < 0)
+        perror("TPR_IOC_COALESCE");
+
+    printf("   %16.16s %8.8s %8.8s\n",
+           "PulseId","Seconds","Nanosec");
+
+    TprCompactReader reader(q, cq, idx);
+    TprCompact entry;
+
+    uint64_t pulseIdP=0;
+    unsigned nframes=0;
+
+    do {
+        TprReader::Result result;
+        while(nframes<10 && (result = reader.next(entry)) != TprReader::Empty) {
+            if (result == TprReader::Lapped) {
+                printf("lapped: %llu entries lost\n", reader.lost());
+                pulseIdP = 0;
+                continue;
+            }
+            if (((entry.tag>>16)&0xf) != 0)  // not an EVENT
+                continue;
+            if (pulseIdP) {
+                printf(" 0x%016llx %9u.%09u %s\n",
+                       (unsigned long long)entry.pulseId,
+                       unsigned(entry.timeStamp>>32),
+                       unsigned(entry.timeStamp&0xffffffff),
+                       (entry.pulseId==pulseIdP+1) ? "PASS":"FAIL");
+                nframes++;
+            }
+            pulseIdP = entry.pulseId;
+        }
+        if (nframes>=10)
+            break;
+        wait_for_data(fd);
+    } while(1);
+
+    munmap((void*)cq, q.hdr.compactSize);
+    munmap((void*)qp, qsize);
+    close(fd);
+}
+
+void zc_capture(char tprid, unsigned idx)
+{
+    char dev[16];
+    sprintf(dev,"/dev/tpr%c%x",tprid,idx);
+
+    int fd = open(dev, O_RDONLY);
+    if (fd<0) {
+        printf("Open failure for dev %s [FAIL]\n",dev);
+        perror("Could not open");
+        return;
+    }
+
+    size_t qsize;
+    const TprQueues* qp = tprMapQueues(fd, qsize);
+    if (!qp) {
+        printf("Failed to map - FAIL\n");
+        return;
+    }
+
+    if (!qp->hdr.rxbufOffset) {
+        printf("No rx buffers to map (driver loaded with zero_copy=1?) - FAIL\n");
+        return;
+    }
+
+    const size_t bufsz = qp->hdr.rxBufSize;
+    const size_t rxsz  = qp->hdr.rxBuffers*bufsz;
+    void* rxptr = mmap(0, rxsz, PROT_READ, MAP_SHARED, fd, qp->hdr.rxbufOffset);
+    if (rxptr == MAP_FAILED) {
+        perror("Failed to map rx buffers - FAIL");
+        return;
+    }
+    const char* rx = reinterpret_cast<const char*>(rxptr);
+
+    printf("   %16.16s %8.8s %8.8s\n",
+           "PulseId","Seconds","Nanosec");
+
+    const TprQueues& q = *qp;
+
+    char* buff = new char[32];
+
+    //  Index-free, walk every allq position and scan for the channel
+    auto wp = [&]() -> int64_t { return q.indexFree() ? q.gwp : q.allwp[idx]; };
+    int64_t allrp = wp();
+    read(fd, buff, 32);
+
+    uint64_t pulseIdP=0;
+    uint64_t pulseId, timeStamp;
+    unsigned nframes=0, nlost=0;
+
+    do {
+        uint64_t epoch = 0;
+        int64_t  w;
+        while(allrp < (w = wp()) && nframes<10) {
+            int64_t pos = q.indexFree() ? q.scan(idx, allrp, w) : q.allrp(idx, allrp);
+            if (pos == w) {
+                allrp = w;
+                continue;
+            }
+            if (q.indexFree())
+                allrp = pos;
+            const TprZcDesc& d = q.zcq(pos);
+            epoch = d.epoch;
+            volatile const uint32_t* p = reinterpret_cast<volatile const uint32_t*>
+                (rx + size_t(d.buf)*bufsz + d.offset);
+            bool ok = parse_frame(p, pulseId, timeStamp);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (q.zcfree > (long long)epoch) {  // buffer was recycled under us
+                nlost++;
+                pulseIdP = 0;
+            }
+            else if (verbose)
+                dump_frame(p);
+            else if (ok) {
+                if (pulseIdP) {
+                    printf(" 0x%016llx %9u.%09u %s\n",
+                           (unsigned long long)pulseId,
+                           unsigned(timeStamp>>32),
+                           unsigned(timeStamp&0xffffffff),
+                           (pulseId==pulseIdP+1) ? "PASS":"FAIL");
+                    nframes++;
+                }
+                pulseIdP  =pulseId;
+            }
             allrp++;
         }
+        //  Buffers before the last one read are no longer needed
+        if (epoch)
+            ioctl(fd, TPR_IOC_ZC_RELEASE, &epoch);
         if (nframes>=10)
             break;
         read(fd, buff, 32);
     } while(1);
 
+    if (nlost)
+        printf("%u frames recycled before they were read\n", nlost);
+
+    munmap(rxptr, rxsz);
+    munmap((void*)qp, qsize);
+    close(fd);
 }
 
 void dump_frame(volatile const uint32_t* p)
 {
+    if (((p[0]>>16)&0xf)==DROP_TAG) {
+        printf("DROP  chmask [x%x]\n", p[1]);
+        return;
+    }
     char m = p[0]&(0x808<<20) ? 'D':' ';
     if (((p[0]>>16)&0xf)==0) {
         volatile const uint64_t* pl = reinterpret_cast<volatile const uint64_t*>(p+2);
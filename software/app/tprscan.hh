@@ -0,0 +1,91 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'SLAC EVR Gen2', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Scan of the allmask tag words (driver loaded with index_free=1) for the
+//  entries of a channel.  Plain C++ on the raw array so that the queue
+//  reader (tprsh.hh) and the benchmark (tprbench.cc) share it.
+//
+#ifndef TPRSCAN_HH
+#define TPRSCAN_HH
+
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace Tpr {
+  //  Index of the first of n tag words with a bit of mask set, n if none
+  inline unsigned tprScanScalar(const uint32_t* t, unsigned n, uint32_t mask) {
+    unsigned i = 0;
+    while (i < n && !(t[i] & mask))
+      i++;
+    return i;
+  }
+
+#if defined(__x86_64__)
+  inline unsigned tprScanSse2(const uint32_t* t, unsigned n, uint32_t mask) {
+    const __m128i m = _mm_set1_epi32(mask);
+    const __m128i z = _mm_setzero_si128();
+    unsigned i = 0;
+    for(; i+4 <= n; i+=4) {
+      __m128i  v    = _mm_and_si128(_mm_loadu_si128((const __m128i*)(t+i)), m);
+      unsigned hits = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, z))) & 0xf;
+      if (hits)
+        return i + __builtin_ctz(hits);
+    }
+    return i + tprScanScalar(t+i, n-i, mask);
+  }
+
+  __attribute__((target("avx2")))
+  inline unsigned tprScanAvx2(const uint32_t* t, unsigned n, uint32_t mask) {
+    const __m256i m = _mm256_set1_epi32(mask);
+    const __m256i z = _mm256_setzero_si256();
+    unsigned i = 0;
+    for(; i+8 <= n; i+=8) {
+      __m256i  v    = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(t+i)), m);
+      unsigned hits = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, z))) & 0xff;
+      if (hits)
+        return i + __builtin_ctz(hits);
+    }
+    return i + tprScanScalar(t+i, n-i, mask);
+  }
+#endif
+
+  //
+  //  The first position in [rp, wp) whose tag word has a bit of mask set,
+  //  or wp if none.  tags is the ring of depth (a power of two) tag words.
+  //  The words are read without ordering; the caller validates what it
+  //  finds against the entry's seq and the write pointer.
+  //
+  inline long long tprScanTags(const volatile uint32_t* tags, unsigned depth,
+                               long long rp, long long wp, uint32_t mask) {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    const uint32_t* t = const_cast<const uint32_t*>(tags);
+    if (rp < wp && (t[rp & (depth-1)] & mask))   // dense channels hit at once
+      return rp;
+    while (rp < wp) {
+      unsigned off = rp & (depth-1);
+      unsigned n   = (wp - rp < depth - off) ? unsigned(wp - rp) : depth - off;
+#if defined(__x86_64__)
+      unsigned i   = avx2 ? tprScanAvx2(t+off, n, mask) : tprScanSse2(t+off, n, mask);
+#else
+      unsigned i   = tprScanScalar(t+off, n, mask);
+#endif
+      if (i < n)
+        return rp + i;
+      rp += n;
+    }
+    return wp;
+  }
+};
+
+#endif
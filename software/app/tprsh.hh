@@ -10,36 +10,507 @@
 #ifndef TPRSH_HH
 #define TPRSH_HH
 
-#define MOD_SHARED 14
-#define MAX_TPR_ALLQ (32*1024)
-#define MAX_TPR_BSAQ  1024
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#include "tprscan.hh"
+
+#define MOD_SHARED 14   // control minor
+#define MAX_CHANNELS 16 // channel streams the layout has room for (hdr.nchan in use)
+#define MOD_BSA    64
 #define MSG_SIZE      32
+#define TPR_PAGE_SIZE 4096
 
 namespace Tpr {
-  // DMA Buffer Size, Bytes (could be as small as 512B)
-#define BUF_SIZE 4096
-#define NUMBER_OF_RX_BUFFERS 256
+  //  Wake once minEntries are pending or the oldest has waited maxDelayUs
+  //  (zero disables either; both zero wakes on every driver pass)
+  struct tpr_coalesce {
+    uint32_t minEntries;
+    uint32_t maxDelayUs;
+  };
+
+  //  Per-open event filter; a zero field passes everything.  Entries that
+  //  pass are indexed into the open's TprFiltQueue (hdr.filtOffset).
+#define TPR_FILTER_NOBEAM (1<<16)  // destMask bit for frames without beam
+  struct tpr_filter {
+    uint32_t decimate;   // every Nth entry
+    uint32_t modulo;     // pulseId % modulo == phase
+    uint32_t phase;
+    uint32_t destMask;   // beam destinations (bit n: destination n)
+  };
+
+  //  read() mode of an open (TPR_IOC_READMODE).  With TPR_READ_ENTRIES a
+  //  read copies whole TprEntry records from a cursor kept by the driver for
+  //  this open, followed by a tpr_read_trailer.  Not with zero_copy.
+#define TPR_READ_PENDING 0  // the pending irq mask (default)
+#define TPR_READ_ENTRIES 1
+  struct tpr_read_trailer {
+    uint32_t entries;    // TprEntry records ahead of the trailer
+    uint32_t reserved;
+    int64_t  rp;         // cursor after this read
+    int64_t  wp;         // stream write pointer when last checked
+    uint64_t lost;       // entries overwritten before they were read (index-free: allq positions)
+    uint64_t drops;      // firmware drops seen by the stream
+  };
+
+  template <typename T>
+  inline T tprLoadAcquire(const volatile T& v) {
+    return std::atomic_ref<T>(const_cast<T&>(v)).load(std::memory_order_acquire);
+  }
+
+#define TPR_IOC_MAGIC      0xB7
+#define TPR_IOC_ZC_RELEASE _IOW(TPR_IOC_MAGIC, 1, uint64_t)
+#define TPR_IOC_EVENTFD    _IOW(TPR_IOC_MAGIC, 2, int)  // eventfd credited with new entries (-1 to clear)
+#define TPR_IOC_COALESCE   _IOW(TPR_IOC_MAGIC, 3, Tpr::tpr_coalesce)
+#define TPR_IOC_FILTER     _IOW(TPR_IOC_MAGIC, 4, Tpr::tpr_filter)
+#define TPR_IOC_READMODE   _IOW(TPR_IOC_MAGIC, 5, int)  // TPR_READ_PENDING or TPR_READ_ENTRIES
 
   class TprEntry {
   public:
     volatile uint32_t word[MSG_SIZE];
     volatile uint64_t fifo_tsc;
+    volatile long long seq;   // queue position, TPR_SEQ_BUSY while rewritten
   };
 
-  class TprQIndex {
+#define TPR_SEQ_BUSY (-1LL)
+#define DROP_TAG     14    // driver marker: firmware dropped messages before this entry
+
+  //  Per-channel accounting, reset when the channel is first opened
+  class TprChStats {
   public:
-    volatile long long idx[MAX_TPR_ALLQ];
+    volatile long long drops;
+    volatile long long dmaErrors;
+    volatile long long entries;
+  };
+
+  //
+  //  Zero-copy descriptor (driver loaded with zero_copy=1)
+  //  The message is at offset in rx buffer buf, mapped read-only at
+  //  hdr.rxbufOffset.  It is valid if zcfree <= epoch after reading it.
+  //  Release buffers with ioctl(fd, TPR_IOC_ZC_RELEASE, &epoch).
+  //
+  class TprZcDesc {
+  public:
+    volatile uint32_t buf;
+    volatile uint32_t offset;
+    volatile uint32_t tag;
+    volatile uint32_t reserved;
+    volatile uint64_t epoch;
+    volatile uint64_t fifo_tsc;
+    volatile long long seq;
+  };
+
+  //
+  //  Compact record of an allq position (driver loaded with compact_queue=1)
+  //  The ring parallels allq, so allrp indexes it too.  seq is the low 32
+  //  bits of the position, ~position while the slot is rewritten.
+  //
+  class TprCompact {
+  public:
+    volatile uint64_t pulseId;
+    volatile uint64_t timeStamp;   // seconds 63:32, nanoseconds 31:0
+    volatile uint32_t tag;         // first word of the message
+    volatile uint32_t seq;
+    volatile uint64_t fifo_tsc;
+  };
+
+  //
+  //  Layout of the mapped queues (see kernel/tpr.h).  The depths are set
+  //  when the driver is loaded, so everything past the header is located
+  //  through it.  Offsets of queues unused in the driver's mode are 0.
+  //
+#define TPR_Q_MAGIC    0x51525054   // "TPRQ"
+#define TPR_Q_VERSION  8
+
+  class TprQHeader {
+  public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hdrSize;
+    uint32_t entrySize;
+    uint32_t zcDescSize;
+    uint32_t nchan;        // channels of the firmware, each with an allrp stream
+    uint32_t allqDepth;
+    uint32_t bsaqDepth;
+    uint32_t chnqDepth;
+    uint32_t rxBuffers;
+    uint32_t rxBufSize;
+    int32_t  node;         // NUMA node of the card; pin consumers there (-1 if unknown)
+    uint64_t allqOffset;
+    uint64_t bsaqOffset;
+    uint64_t allrpOffset;
+    uint64_t zcqOffset;
+    uint64_t zcbsaqOffset;
+    uint64_t shmSize;      // bytes mappable at offset 0
+    uint64_t chnqOffset;   // mmap offset of a channel's copy queue
+    uint64_t chnqSize;
+    uint64_t rxbufOffset;  // mmap offset of the rx buffers
+    uint64_t filtOffset;   // mmap offset of this open's filtered index
+    uint32_t filtDepth;
+    uint32_t nbsa;
+    uint64_t bsarpOffset;  // per BSA array index into bsaq
+    uint32_t ntrig;        // trigger outputs of the firmware
+    uint32_t compactEntrySize;
+    uint64_t compactOffset; // mmap offset of the compact ring, 0 if none
+    uint64_t compactSize;
+    uint64_t allmaskOffset; // tag words in place of allrp (index_free), 0 if indexed
+  };
+
+  //
+  //  fifo_tsc to clock time, refreshed by the driver (tsc_cal_ms)
+  //    mono = this.mono + (((tsc - this.tsc) * mult) >> shift)   [ns]
+  //  Consistent while gen is even and unchanged across the read.
+  //
+  class TprTscCal {
+  public:
+    volatile uint32_t gen;
+    volatile uint32_t shift;
+    volatile uint64_t mult;
+    volatile uint64_t tsc;
+    volatile uint64_t mono;
+    volatile int64_t  taiOffset;  // CLOCK_TAI - CLOCK_MONOTONIC
+  public:
+    //  CLOCK_MONOTONIC [ns] of a fifo_tsc, and its CLOCK_TAI if tai is given
+    uint64_t monoNs(uint64_t t, uint64_t* tai=0) const {
+      uint32_t g;
+      uint64_t ns;
+      int64_t  off;
+      do {
+        while ((g = tprLoadAcquire(gen)) & 1)
+          ;
+        __int128 d = (__int128)(int64_t)(t - tsc) * (__int128)mult;
+        ns  = mono + (int64_t)(d >> shift);
+        off = taiOffset;
+        std::atomic_thread_fence(std::memory_order_acquire);
+      } while (std::atomic_ref<uint32_t>(const_cast<uint32_t&>(gen))
+               .load(std::memory_order_relaxed) != g);
+      if (tai)
+        *tai = ns + off;
+      return ns;
+    }
   };
 
   class TprQueues {
   public:
-    TprEntry  allq  [MAX_TPR_ALLQ];
-    TprEntry  bsaq  [MAX_TPR_BSAQ];
-    TprQIndex allrp [MOD_SHARED]; // indices into allq
-    volatile long long allwp [MOD_SHARED]; // write pointer into allrp
+    TprQHeader hdr;
+    TprTscCal  tsccal;
+    volatile long long allwp [MAX_CHANNELS]; // write pointer into allrp
     volatile long long bsawp;
     volatile long long gwp;
     volatile int       fifofull;
+    volatile long long zcfree;
+    TprChStats chstat[MAX_CHANNELS];
+    TprChStats bsastat;
+    volatile long long bsaiwp[MOD_BSA];    // write pointer into bsarp
+  public:
+    //  Null if the driver's layout matches this header, else the reason
+    const char* mismatch() const {
+      if (hdr.magic   != TPR_Q_MAGIC)   return "bad magic";
+      if (hdr.version != TPR_Q_VERSION) return "layout version mismatch";
+      if (hdr.hdrSize != sizeof(TprQueues) || hdr.entrySize != sizeof(TprEntry) ||
+          hdr.zcDescSize != sizeof(TprZcDesc) || hdr.nchan > MAX_CHANNELS ||
+          hdr.nbsa != MOD_BSA ||
+          (hdr.compactOffset && hdr.compactEntrySize != sizeof(TprCompact)))
+        return "structure size mismatch";
+      return 0;
+    }
+    unsigned allqMask() const { return hdr.allqDepth-1; }
+    unsigned bsaqMask() const { return hdr.bsaqDepth-1; }
+    const TprEntry&  allq  (long long pos) const { return _at<TprEntry >(hdr.allqOffset  )[pos & allqMask()]; }
+    const TprEntry&  bsaq  (long long pos) const { return _at<TprEntry >(hdr.bsaqOffset  )[pos & bsaqMask()]; }
+    const TprZcDesc& zcq   (long long pos) const { return _at<TprZcDesc>(hdr.zcqOffset   )[pos & allqMask()]; }
+    const TprZcDesc& zcbsaq(long long pos) const { return _at<TprZcDesc>(hdr.zcbsaqOffset)[pos & bsaqMask()]; }
+    //  Index-free (no allrp): channels scan the tag words of allq positions
+    bool indexFree() const { return hdr.allmaskOffset != 0; }
+    const volatile uint32_t* allmask() const { return _at<volatile uint32_t>(hdr.allmaskOffset); }
+    //  First allq position in [rp, wp) for channel ch, or wp
+    long long scan(unsigned ch, long long rp, long long wp) const {
+      return tprScanTags(allmask(), hdr.allqDepth, rp, wp, 1u<<ch);
+    }
+    //  allq position of the rp'th entry for channel ch
+    const volatile long long& allrp(unsigned ch, long long rp) const {
+      return _at<volatile long long>(hdr.allrpOffset)[size_t(ch)*hdr.allqDepth + (rp & allqMask())];
+    }
+    //  bsaq position of the rp'th entry touching BSA array arr
+    const volatile long long& bsarp(unsigned arr, long long rp) const {
+      return _at<volatile long long>(hdr.bsarpOffset)[size_t(arr)*hdr.bsaqDepth + (rp & bsaqMask())];
+    }
+  private:
+    template <typename T> const T* _at(uint64_t off) const {
+      return reinterpret_cast<const T*>(reinterpret_cast<const char*>(this) + off);
+    }
+  };
+
+  //
+  //  Map the queues of an open tpr device (all of hdr.shmSize), checking
+  //  the layout.  Returns 0 on failure, after saying why.
+  //
+  inline const TprQueues* tprMapQueues(int fd, size_t& size) {
+    void* p = mmap(0, TPR_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      perror("Failed to map queue header");
+      return 0;
+    }
+    const TprQueues* q = reinterpret_cast<const TprQueues*>(p);
+    if (const char* why = q->mismatch()) {
+      fprintf(stderr, "tpr queues: %s (driver magic %08x version %u)\n",
+              why, q->hdr.magic, q->hdr.version);
+      munmap(p, TPR_PAGE_SIZE);
+      return 0;
+    }
+    size = q->hdr.shmSize;
+    munmap(p, TPR_PAGE_SIZE);
+    p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      perror("Failed to map queues");
+      return 0;
+    }
+    return reinterpret_cast<const TprQueues*>(p);
+  }
+
+  //
+  //  Private per-channel copy queue (driver loaded with chan_queues=1)
+  //  Map hdr.chnqSize bytes at hdr.chnqOffset from the channel device.
+  //
+  class TprChQueue {
+  public:
+    volatile long long chnwp;
+    long long          reserved[7];
+    const TprEntry& chnq(long long pos, unsigned depth) const {
+      return reinterpret_cast<const TprEntry*>(this+1)[pos & (depth-1)];
+    }
+  };
+
+  //
+  //  Filtered index of one open (after ioctl TPR_IOC_FILTER)
+  //  Map it with tprMapFilter() on the same file descriptor.
+  //
+  class TprFiltQueue {
+  public:
+    volatile long long fwp;
+    long long          reserved[7];
+    const volatile long long& fidx(long long rp, unsigned depth) const {
+      return reinterpret_cast<const volatile long long*>(this+1)[rp & (depth-1)];
+    }
+  };
+
+  inline const TprFiltQueue* tprMapFilter(int fd, const TprQHeader& hdr, size_t& size) {
+    size = (sizeof(TprFiltQueue) + size_t(hdr.filtDepth)*sizeof(long long) + TPR_PAGE_SIZE-1)
+      & ~size_t(TPR_PAGE_SIZE-1);
+    void* p = mmap(0, size, PROT_READ, MAP_SHARED, fd, hdr.filtOffset);
+    if (p == MAP_FAILED) {
+      perror("Failed to map filtered index");
+      return 0;
+    }
+    return reinterpret_cast<const TprFiltQueue*>(p);
+  }
+
+  //
+  //  Compact ring (driver loaded with compact_queue=1): allqDepth records
+  //  mapped at hdr.compactOffset.  Returns 0 on failure, after saying why.
+  //
+  inline const TprCompact* tprMapCompact(int fd, const TprQHeader& hdr) {
+    if (!hdr.compactOffset) {
+      fprintf(stderr, "tpr queues: no compact ring (driver loaded with compact_queue=1?)\n");
+      return 0;
+    }
+    void* p = mmap(0, hdr.compactSize, PROT_READ, MAP_SHARED, fd, hdr.compactOffset);
+    if (p == MAP_FAILED) {
+      perror("Failed to map compact ring");
+      return 0;
+    }
+    return reinterpret_cast<const TprCompact*>(p);
+  }
+
+  //
+  //  Publication protocol (see kernel/tpr.h)
+  //    The driver stamps each entry with its queue position after writing
+  //    it (TPR_SEQ_BUSY while rewriting), then release-stores the write
+  //    pointer.  A reader acquires the write pointer, checks the stamp before
+  //    and after copying the entry, and re-checks the write pointer to make
+  //    sure the index it followed had not been reused.
+  //
+  //  Copy the entry at queue position pos.  False if it was overwritten.
+  inline bool tprCopyEntry(const TprEntry& src, long long pos, TprEntry& dst) {
+    if (tprLoadAcquire(src.seq) != pos)
+      return false;
+    for(unsigned i=0; i<MSG_SIZE; i++)
+      dst.word[i] = src.word[i];
+    dst.fifo_tsc = src.fifo_tsc;
+    dst.seq      = pos;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return std::atomic_ref<long long>(const_cast<long long&>(src.seq))
+      .load(std::memory_order_relaxed) == pos;
+  }
+
+  //  Copy the compact record of queue position pos.  False if it was overwritten.
+  inline bool tprCopyCompact(const TprCompact& src, long long pos, TprCompact& dst) {
+    uint32_t seq = uint32_t(pos);
+    if (tprLoadAcquire(src.seq) != seq)
+      return false;
+    dst.pulseId   = src.pulseId;
+    dst.timeStamp = src.timeStamp;
+    dst.tag       = src.tag;
+    dst.fifo_tsc  = src.fifo_tsc;
+    dst.seq       = seq;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return std::atomic_ref<uint32_t>(const_cast<uint32_t&>(src.seq))
+      .load(std::memory_order_relaxed) == seq;
+  }
+
+  //  Where a reader at rp resumes when the driver has overwritten what it
+  //  was about to read (see the resume rule in tpr_queues.h)
+  inline long long tprResume(long long rp, long long wp, long long depth) {
+    return wp-depth+1 > rp+1 ? wp-depth+1 : rp+1;
+  }
+
+  //
+  //  Lock-free reader of one channel's allrp stream (or the bsaq, one BSA
+  //  array's bsarp stream, or an open's filtered index)
+  //    next() returns Empty when caught up, Lapped when the driver has
+  //    overwritten unread entries (the reader resumes at the oldest slot
+  //    still good and counts the loss), and Ok with a consistent copy
+  //    otherwise.  read() in TPR_READ_ENTRIES mode counts the same way.
+  //  With an index-free driver a channel reader scans the allq tag words
+  //  instead; its position and losses are then in allq positions.
+  //
+  class TprReader {
+  public:
+    enum Result { Empty, Ok, Lapped };
+    TprReader(const TprQueues& q, unsigned ch) :
+      _q(q), _f(0), _ch(ch), _rp(_wp()), _lost(0) {}
+    static TprReader bsa(const TprQueues& q) {
+      return TprReader(q, MAX_CHANNELS);
+    }
+    static TprReader bsaArray(const TprQueues& q, unsigned arr) {
+      return TprReader(q, MAX_CHANNELS+1+arr);
+    }
+    TprReader(const TprQueues& q, const TprFiltQueue& f) :
+      _q(q), _f(&f), _ch(0), _rp(_wp()), _lost(0) {}
+    Result next(TprEntry& e) {
+      long long wp = _wp();
+      if (_rp == wp)
+        return Empty;
+      if (wp - _rp >= _depth())
+        return _resync(wp);
+      if (_scan())
+        return _nextScan(e, wp);
+      long long pos = _f ? tprLoadAcquire(_f->fidx(_rp, _q.hdr.filtDepth)) :
+        _ch < MAX_CHANNELS ? tprLoadAcquire(_q.allrp(_ch, _rp)) :
+        _ch > MAX_CHANNELS ? tprLoadAcquire(_q.bsarp(_ch-MAX_CHANNELS-1, _rp)) : _rp;
+      const TprEntry& src = _ch < MAX_CHANNELS ? _q.allq(pos) : _q.bsaq(pos);
+      if (!tprCopyEntry(src, pos, e))
+        return _resync(_wp());
+      if ((wp = _wp()) - _rp >= _depth())
+        return _resync(wp);
+      _rp++;
+      return Ok;
+    }
+    long long          position() const { return _rp; }
+    unsigned long long lost    () const { return _lost; }
+  private:
+    bool _scan() const { return !_f && _ch < MAX_CHANNELS && _q.indexFree(); }
+    Result _nextScan(TprEntry& e, long long wp) {
+      long long pos = _q.scan(_ch, _rp, wp);
+      long long nwp = _wp();
+      if (nwp - _rp >= _depth())      // tags scanned may have been rewritten
+        return _resync(nwp);
+      if (pos == wp) {
+        _rp = wp;
+        return Empty;
+      }
+      if (!tprCopyEntry(_q.allq(pos), pos, e)) {
+        _rp = pos;
+        return _resync(_wp());
+      }
+      _rp = pos+1;
+      return Ok;
+    }
+    long long _wp() const {
+      return _f ? tprLoadAcquire(_f->fwp) :
+        _ch < MAX_CHANNELS ? (_q.indexFree() ? tprLoadAcquire(_q.gwp) : tprLoadAcquire(_q.allwp[_ch])) :
+        _ch > MAX_CHANNELS ? tprLoadAcquire(_q.bsaiwp[_ch-MAX_CHANNELS-1]) : tprLoadAcquire(_q.bsawp);
+    }
+    long long _depth() const {
+      return _f ? _q.hdr.filtDepth : _ch < MAX_CHANNELS ? _q.hdr.allqDepth : _q.hdr.bsaqDepth;
+    }
+    Result _resync(long long wp) {
+      long long rp = tprResume(_rp, wp, _depth());
+      _lost += rp - _rp;
+      _rp = rp;
+      return Lapped;
+    }
+  private:
+    const TprQueues&   _q;
+    const TprFiltQueue* _f;    // filtered index, or 0
+    unsigned           _ch;    // channel, MAX_CHANNELS for BSA, MAX_CHANNELS+1+arr for a BSA array
+    long long          _rp;
+    unsigned long long _lost;
+  };
+
+  //
+  //  Reader of one channel's allrp stream through the compact ring, or of
+  //  every allq position (all()).  Same results as TprReader.
+  //
+  class TprCompactReader {
+  public:
+    TprCompactReader(const TprQueues& q, const TprCompact* c, unsigned ch) :
+      _q(q), _c(c), _ch(ch), _rp(_wp()), _lost(0) {}
+    static TprCompactReader all(const TprQueues& q, const TprCompact* c) {
+      return TprCompactReader(q, c, MAX_CHANNELS);
+    }
+    TprReader::Result next(TprCompact& e) {
+      long long wp = _wp();
+      if (_rp == wp)
+        return TprReader::Empty;
+      if (wp - _rp >= _q.hdr.allqDepth)
+        return _resync(wp);
+      long long pos;
+      if (_ch < MAX_CHANNELS && _q.indexFree()) {
+        pos = _q.scan(_ch, _rp, wp);
+        long long nwp = _wp();
+        if (nwp - _rp >= _q.hdr.allqDepth)
+          return _resync(nwp);
+        if (pos == wp) {
+          _rp = wp;
+          return TprReader::Empty;
+        }
+        if (!tprCopyCompact(_c[pos & _q.allqMask()], pos, e)) {
+          _rp = pos;
+          return _resync(_wp());
+        }
+        _rp = pos+1;
+        return TprReader::Ok;
+      }
+      pos = _ch < MAX_CHANNELS ? tprLoadAcquire(_q.allrp(_ch, _rp)) : _rp;
+      if (!tprCopyCompact(_c[pos & _q.allqMask()], pos, e))
+        return _resync(_wp());
+      if ((wp = _wp()) - _rp >= _q.hdr.allqDepth)
+        return _resync(wp);
+      _rp++;
+      return TprReader::Ok;
+    }
+    long long          position() const { return _rp; }
+    unsigned long long lost    () const { return _lost; }
+  private:
+    long long _wp() const {
+      return _ch < MAX_CHANNELS && !_q.indexFree() ? tprLoadAcquire(_q.allwp[_ch]) : tprLoadAcquire(_q.gwp);
+    }
+    TprReader::Result _resync(long long wp) {
+      long long rp = tprResume(_rp, wp, _q.hdr.allqDepth);
+      _lost += rp - _rp;
+      _rp = rp;
+      return TprReader::Lapped;
+    }
+  private:
+    const TprQueues&   _q;
+    const TprCompact*  _c;
+    unsigned           _ch;    // channel, MAX_CHANNELS for every position
+    long long          _rp;
+    unsigned long long _lost;
   };
 };
 
@@ -0,0 +1,240 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'SLAC EVR Gen2', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Subscriber churn under traffic: one reader follows a channel while
+//  worker threads keep hundreds of other opens coming and going on the
+//  same channel (and optionally the BSA minor).  The channel's event
+//  selection must already be set up (tprtrig), as for tprdump.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tprsh.hh"
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+using namespace Tpr;
+
+extern int optind;
+
+static void usage(const char* p) {
+  printf("Usage: %s [options]\n",p);
+  printf("          -d <dev>  : <tpr a/b>\n");
+  printf("          -c <chan> : channel to read and churn on (default 0)\n");
+  printf("          -n <subs> : subscribers kept open by the workers (default 200)\n");
+  printf("          -t <thr>  : worker threads (default 4)\n");
+  printf("          -s <sec>  : run time (default 10)\n");
+  printf("          -b        : also churn the BSA minor\n");
+}
+
+static char     tprid    = 'a';
+static unsigned channel  = 0;
+static unsigned nsubs    = 200;
+static unsigned nthreads = 4;
+static unsigned seconds  = 10;
+static bool     lBsa     = false;
+
+static std::atomic<bool>     done(false);
+static std::atomic<uint64_t> nopen(0), nclose(0), nfail(0);
+static std::atomic<uint64_t> closeNsMax(0), closeNsSum(0);
+
+static uint64_t now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+}
+
+//  Open, hold and close subscribers at random.  Every other open asks for
+//  coalesced wakeups and every fourth for a filter, so the release path has
+//  all of its state to tear down.
+static void* churn(void* arg)
+{
+  unsigned id   = reinterpret_cast<uintptr_t>(arg);
+  unsigned hold = nsubs / nthreads;
+  unsigned seed = id;
+  std::vector<int> fds;
+
+  char dev[16], bsadev[16];
+  sprintf(dev   ,"/dev/tpr%c%x",tprid,channel);
+  sprintf(bsadev,"/dev/tpr%cBSA",tprid);
+
+  while(!done) {
+    if (fds.size() < hold && (fds.empty() || rand_r(&seed)&1)) {
+      bool bsa = lBsa && (rand_r(&seed)%8)==0;
+      int fd = open(bsa ? bsadev : dev, O_RDONLY);
+      if (fd < 0) {
+        nfail++;
+        usleep(1000);
+        continue;
+      }
+      if (!bsa && (nopen&1)) {
+        tpr_coalesce c = { 8, 1000 };
+        ioctl(fd, TPR_IOC_COALESCE, &c);
+      }
+      if (!bsa && (nopen&3)==0) {
+        tpr_filter f = { 2, 0, 0, 0 };
+        ioctl(fd, TPR_IOC_FILTER, &f);
+      }
+      fds.push_back(fd);
+      nopen++;
+    }
+    else if (!fds.empty()) {
+      unsigned i = rand_r(&seed) % fds.size();
+      uint64_t t0 = now_ns();
+      close(fds[i]);
+      uint64_t dt = now_ns() - t0;
+      fds[i] = fds.back();
+      fds.pop_back();
+      nclose++;
+      closeNsSum += dt;
+      uint64_t m = closeNsMax;
+      while (dt > m && !closeNsMax.compare_exchange_weak(m, dt))
+        ;
+    }
+  }
+
+  for(unsigned i=0; i<fds.size(); i++)
+    close(fds[i]);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+
+  extern char* optarg;
+  int c;
+  bool lUsage = false;
+
+  while ( (c=getopt( argc, argv, "d:c:n:t:s:bh?")) != EOF ) {
+    switch(c) {
+    case 'd':
+      tprid  = optarg[0];
+      if (strlen(optarg) != 1) {
+        printf("%s: option `-d' parsing error\n", argv[0]);
+        lUsage = true;
+      }
+      break;
+    case 'c':
+      channel = strtoul(optarg,NULL,0);
+      break;
+    case 'n':
+      nsubs = strtoul(optarg,NULL,0);
+      break;
+    case 't':
+      nthreads = std::max(1UL,strtoul(optarg,NULL,0));
+      break;
+    case 's':
+      seconds = strtoul(optarg,NULL,0);
+      break;
+    case 'b':
+      lBsa = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    case '?':
+    default:
+      lUsage = true;
+      break;
+    }
+  }
+
+  if (optind < argc || channel >= MAX_CHANNELS)
+    lUsage = true;
+
+  if (lUsage) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  char dev[16];
+  sprintf(dev,"/dev/tpr%c%x",tprid,channel);
+
+  int fd = open(dev, O_RDONLY);
+  if (fd<0) {
+    perror(dev);
+    return -1;
+  }
+
+  size_t qsize;
+  const TprQueues* qp = tprMapQueues(fd, qsize);
+  if (!qp)
+    return -2;
+
+  std::vector<pthread_t> threads(nthreads);
+  for(unsigned i=0; i<nthreads; i++)
+    pthread_create(&threads[i], 0, churn, reinterpret_cast<void*>(uintptr_t(i+1)));
+
+  //  Follow the channel with blocking reads, as a normal client would
+  TprReader reader(*qp, channel);
+  TprEntry  entry;
+  uint64_t  entries=0, lapped=0, gapNsMax=0;
+  uint64_t  t0 = now_ns(), tlast = t0, twake = t0;
+  uint64_t  nopenP=0, ncloseP=0, entriesP=0;
+
+  printf("%6s %12s %10s %10s %10s %10s %12s %12s\n",
+         "sec", "entries/s", "lost", "opens/s", "closes/s", "failed", "close[us]", "maxgap[us]");
+
+  while(1) {
+    uint32_t pending;
+    read(fd, &pending, sizeof(pending));
+    uint64_t t = now_ns();
+    gapNsMax = std::max(gapNsMax, t - twake);
+    twake = t;
+
+    TprReader::Result result;
+    while((result = reader.next(entry)) != TprReader::Empty) {
+      if (result == TprReader::Lapped)
+        lapped++;
+      else
+        entries++;
+    }
+
+    if (t - tlast >= 1000000000ULL) {
+      uint64_t o = nopen, cl = nclose;
+      double   dt = double(t - tlast)*1.e-9;
+      printf("%6.1f %12.0f %10llu %10.0f %10.0f %10llu %12.1f %12.1f\n",
+             double(t - t0)*1.e-9,
+             double(entries - entriesP)/dt,
+             (unsigned long long)reader.lost(),
+             double(o - nopenP)/dt,
+             double(cl - ncloseP)/dt,
+             (unsigned long long)nfail.load(),
+             cl ? double(closeNsSum)/double(cl)*1.e-3 : 0.,
+             double(gapNsMax)*1.e-3);
+      nopenP = o; ncloseP = cl; entriesP = entries;
+      gapNsMax = 0;
+      tlast = t;
+      if (t - t0 >= uint64_t(seconds)*1000000000ULL)
+        break;
+    }
+  }
+
+  done = true;
+  for(unsigned i=0; i<nthreads; i++)
+    pthread_join(threads[i], 0);
+
+  printf("entries %llu  lost %llu (%llu resyncs)  opens %llu  closes %llu  failed %llu  close max %.1f us\n",
+         (unsigned long long)entries, (unsigned long long)reader.lost(), (unsigned long long)lapped,
+         (unsigned long long)nopen.load(), (unsigned long long)nclose.load(),
+         (unsigned long long)nfail.load(), double(closeNsMax)*1.e-3);
+
+  munmap(const_cast<TprQueues*>(qp), qsize);
+  close(fd);
+  return 0;
+}
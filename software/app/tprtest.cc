@@ -347,9 +347,10 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
         return;
     }
 
-    void* ptr = mmap(0, sizeof(TprQueues), PROT_READ, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) {
-        perror("Failed to map - FAIL");
+    size_t qsize;
+    const TprQueues* qp = tprMapQueues(fd, qsize);
+    if (!qp) {
+        printf("Failed to map - FAIL\n");
         return;
     }
 
@@ -357,7 +358,7 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
     unsigned ucontrol = reg.base.channel[_channel].control;
     reg.base.channel[_channel].control = 0;
 
-    reg.base.dump();
+    reg.base.dump(reg.csr.nchannels(), reg.csr.ntriggers());
 
     unsigned urate   = tmode!=LCLS1 ? (markerRev?6:0) : (1<<11) | (0x3f<<3); // max rate
     unsigned destsel = 1<<17; // BEAM - DONT CARE
@@ -366,7 +367,7 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
     reg.base.channel[_channel].bsaWidth = 1;
     reg.base.channel[_channel].control = ucontrol | 5;
 
-    //reg.base.dump();
+    //reg.base.dump(reg.csr.nchannels(), reg.csr.ntriggers());
 
     //  follow bsa
 
@@ -386,13 +387,14 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
     printf("   %16.16s %8.8s %8.8s\n",
            "PulseId","Seconds","Nanosec");
 
-    TprQueues& q = *(TprQueues*)ptr;
+    const TprQueues& q = *qp;
 
     char* buff = new char[32];
 
-    int64_t allrp = q.allwp[idx];
+    TprReader reader(q, idx);
+    TprEntry  entry;
     int64_t bsarp = q.bsawp;
-    printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
+    printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) reader.position(), idx, (uint64_t) q.allwp[idx]);
 
     read(fd, buff, 32);
     read(fdbsa, buff, 32);
@@ -405,10 +407,14 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
     unsigned nframes=0;
 
     do {
-        printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) allrp, idx, (uint64_t) q.allwp[idx]);
-        while(allrp < q.allwp[idx] && nframes<10) {
-            volatile const uint32_t* p = reinterpret_cast<volatile const uint32_t*>
-                (&q.allq[q.allrp[idx].idx[allrp &(MAX_TPR_ALLQ-1)] &(MAX_TPR_ALLQ-1) ].word[0]);
+        printf("allrp %#lx  q.allwp[%d] %#lx\n", (uint64_t) reader.position(), idx, (uint64_t) q.allwp[idx]);
+        TprReader::Result result;
+        while(nframes<10 && (result = reader.next(entry)) != TprReader::Empty) {
+            if (result == TprReader::Lapped) {
+                pulseIdP = 0;
+                continue;
+            }
+            volatile const uint32_t* p = &entry.word[0];
             if (verbose)
                 dump_frame(p);
             if (parse_frame(p, pulseId, timeStamp)) {
@@ -424,7 +430,6 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
                 }
                 pulseIdP  =pulseId;
             }
-            allrp++;
         }
         if (nframes>=10)
             break;
@@ -438,8 +443,7 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
         do {
             printf("bsarp %#lx  q.bsawp %#lx\n", (uint64_t) bsarp, (uint64_t) q.bsawp);
             while(bsarp < q.bsawp && nframes<10) {
-                volatile uint32_t* p = reinterpret_cast<volatile uint32_t*>
-                    (&q.bsaq[bsarp &(MAX_TPR_BSAQ-1)].word[0]);
+                volatile const uint32_t* p = &q.bsaq(bsarp).word[0];
                 if (parse_bsa_control(p, pulseId, timeStamp, init, minor, major)) {
                     printf(" 0x%016llx %9u.%09u I%016llx m%016llx M%016llx\n",
                            (unsigned long long)pulseId,
@@ -467,7 +471,7 @@ void frame_capture(TprReg& reg, char tprid, TimingMode tmode )
         } while(1);
     }
 
-    munmap(ptr, sizeof(TprQueues));
+    munmap((void*)qp, qsize);
     close(fd);
     close(fdbsa);
 }
@@ -550,7 +554,7 @@ void generate_triggers(TprReg& reg, TimingMode tmode)
     reg.base.channel[_channel].bsaWidth = 1;
     reg.base.channel[_channel].control = ucontrol | 1;
 
-    reg.base.dump();
+    reg.base.dump(reg.csr.nchannels(), reg.csr.ntriggers());
 }
 
 void generate_refclk(TprReg& reg, bool enable, TimingMode tmode)
@@ -304,7 +304,7 @@ int main(int argc, char** argv) {
       
       printf("%4.4s|%6.6s|%12.12s|%8.8s|%4.4s|%8.8s\n",
 	     "Chan","Rate","Delay,ns","Width,ns","Pol","RateMeas");
-      for(unsigned i=0; i<Tpr::TprBase::NTRIGGERS; i++) {
+      for(unsigned i=0; i<reg.csr.ntriggers(); i++) {
 	if (reg.base.channel[i].control&1)
 	  printf("%4d|%6.6s|%12.2f|%8.2f|%4.4s|%8d\n",
 		 i, rateStr(reg.base.channel[i].evtSel),
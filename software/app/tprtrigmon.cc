@@ -100,7 +100,7 @@ int main(int argc, char** argv) {
     reg.trgmon.reset=0;
     
     usleep(1000000);
-    reg.trgmon.dump();
+    reg.trgmon.dump(reg.csr.ntriggers());
   }
 
   return 0;
@@ -0,0 +1,303 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'SLAC EVR Gen2', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  DMA tuning daemon.  Samples the firmware's frame and drop counters and
+//  the driver's pass counters of one card, and steers two of its knobs
+//  within bounds:
+//
+//    irq_holdoff_us  (sysfs, the card's interrupt holdoff)
+//      Raised while the interrupt + holdoff pass rate is above target, up
+//      to the latency budget; lowered when well below, and on drops.
+//    dma_full_thr    (sysfs, TprCsr dmaFullThr: the fifo level that pauses dma)
+//      Raised on drops, to absorb bursts; eased back to the low bound
+//      after a quiet period, which bounds the latency queued in the fifo.
+//
+//  Every change is logged.  Everything goes through the card's sysfs
+//  directory, so the exclusive control device stays free for other tools.
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <glob.h>
+
+#include <string>
+#include <algorithm>
+
+extern int optind;
+
+static void usage(const char* p) {
+  printf("Usage: %s [options]\n",p);
+  printf("          -d <dev>    : <tpr a/b>\n");
+  printf("          -p <pci>    : pci device of the card (default: the matching one under /sys/bus/pci/drivers/tpr)\n");
+  printf("          -i <pass/s> : interrupt + holdoff pass rate target (default 20000)\n");
+  printf("          -l <us>     : latency budget, the most holdoff allowed (default 100)\n");
+  printf("          -t <lo,hi>  : dmaFullThr bounds (default 0x200,0x3f2)\n");
+  printf("          -q <ticks>  : quiet ticks before easing dmaFullThr down (default 60)\n");
+  printf("          -s <sec>    : sampling interval (default 1)\n");
+  printf("          -n          : dry run, log what would change\n");
+  printf("          -v          : print every sample\n");
+}
+
+static void logmsg(const char* fmt, ...) __attribute__((format(printf,1,2)));
+
+static void logmsg(const char* fmt, ...)
+{
+  char    stamp[32];
+  time_t  t = time(0);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+  printf("%s ", stamp);
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+  fflush(stdout);
+}
+
+static bool readU64(const std::string& path, uint64_t& v)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f)
+    return false;
+  unsigned long long u;
+  bool ok = fscanf(f, "%llu", &u) == 1;
+  fclose(f);
+  v = u;
+  return ok;
+}
+
+static bool writeU64(const std::string& path, uint64_t v)
+{
+  FILE* f = fopen(path.c_str(), "w");
+  if (!f)
+    return false;
+  bool ok = fprintf(f, "%llu\n", (unsigned long long)v) > 0;
+  return (fclose(f) == 0) && ok;
+}
+
+static bool readThr(const std::string& path, uint32_t& v)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f)
+    return false;
+  int u;
+  bool ok = fscanf(f, "%i", &u) == 1 && u >= 0;
+  fclose(f);
+  v = u;
+  return ok;
+}
+
+//  Cards are lettered in probe order, which follows the pci address
+static std::string findPci(char tprid)
+{
+  glob_t g;
+  std::string path;
+  if (glob("/sys/bus/pci/drivers/tpr/[0-9a-f]*:*", 0, 0, &g) == 0) {
+    unsigned i = tprid - 'a';
+    if (i < g.gl_pathc)
+      path = g.gl_pathv[i];
+    globfree(&g);
+  }
+  return path;
+}
+
+struct Sample {
+  uint64_t ns;
+  uint64_t irqPass, holdPass, pollPass, msgs;
+  uint64_t frames, drops;       // firmware counters, 24 bits
+  uint32_t thr;
+};
+
+static bool sample(const std::string& pci, Sample& s)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  s.ns = uint64_t(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+  std::string stats = pci + "/stats/";
+  return (readU64(stats+"dmaIrqPass" , s.irqPass ) &&
+          readU64(stats+"dmaHoldPass", s.holdPass) &&
+          readU64(stats+"dmaPollPass", s.pollPass) &&
+          readU64(stats+"dmaCount"   , s.msgs    ) &&
+          readU64(stats+"fwDmaCount" , s.frames  ) &&
+          readU64(stats+"fwDmaDrops" , s.drops   ) &&
+          readThr(pci+"/dma_full_thr", s.thr     ));
+}
+
+int main(int argc, char** argv) {
+
+  extern char* optarg;
+  char* endptr;
+  int c;
+  bool lUsage = false;
+
+  char        tprid   = 'a';
+  std::string pci;
+  double      target  = 20000;
+  unsigned    budget  = 100;
+  unsigned    thrLo   = 0x200, thrHi = 0x3f2;
+  unsigned    quietN  = 60;
+  unsigned    period  = 1;
+  bool        lDry    = false;
+  bool        lVerbose = false;
+
+  while ( (c=getopt( argc, argv, "d:p:i:l:t:q:s:nvh?")) != EOF ) {
+    switch(c) {
+    case 'd':
+      tprid  = optarg[0];
+      if (strlen(optarg) != 1) {
+        printf("%s: option `-d' parsing error\n", argv[0]);
+        lUsage = true;
+      }
+      break;
+    case 'p': pci    = optarg; break;
+    case 'i': target = strtod(optarg,NULL); break;
+    case 'l': budget = strtoul(optarg,NULL,0); break;
+    case 't':
+      thrLo = strtoul(optarg,&endptr,0);
+      if (*endptr != ',') {
+        lUsage = true;
+        break;
+      }
+      thrHi = strtoul(endptr+1,NULL,0);
+      break;
+    case 'q': quietN = strtoul(optarg,NULL,0); break;
+    case 's': period = std::max(1UL,strtoul(optarg,NULL,0)); break;
+    case 'n': lDry = true; break;
+    case 'v': lVerbose = true; break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    case '?':
+    default:
+      lUsage = true;
+      break;
+    }
+  }
+
+  if (optind < argc || target <= 0 || thrLo > thrHi || thrHi > 0x3f2)
+    lUsage = true;
+
+  if (lUsage) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  if (pci.empty())
+    pci = findPci(tprid);
+  if (pci.empty()) {
+    printf("No pci device for tpr%c under /sys/bus/pci/drivers/tpr\n", tprid);
+    return -1;
+  }
+  if (pci.find('/') == std::string::npos)
+    pci = "/sys/bus/pci/devices/" + pci;
+  std::string holdoffAttr = pci + "/irq_holdoff_us";
+  std::string thrAttr     = pci + "/dma_full_thr";
+
+  uint64_t holdoff;
+  if (!readU64(holdoffAttr, holdoff)) {
+    perror(holdoffAttr.c_str());
+    return -1;
+  }
+
+  Sample last;
+  if (!sample(pci, last)) {
+    printf("Cannot read the counters under %s\n", pci.c_str());
+    return -1;
+  }
+
+  logmsg("tpr%c (%s): target %.0f pass/s, holdoff %llu us (max %u), dmaFullThr %#x [%#x,%#x]%s",
+         tprid, pci.c_str(), target, (unsigned long long)holdoff, budget,
+         last.thr, thrLo, thrHi, lDry ? ", dry run" : "");
+
+  unsigned quiet = 0;
+  const unsigned holdStep = 5;     // [us]
+  const unsigned thrUp = 0x40, thrDown = 0x10;
+
+  while(1) {
+    sleep(period);
+
+    Sample s;
+    if (!sample(pci, s)) {
+      logmsg("lost %s; stopping", pci.c_str());
+      return -1;
+    }
+
+    double dt     = double(s.ns - last.ns)*1.e-9;
+    double passes = double((s.irqPass + s.holdPass) - (last.irqPass + last.holdPass))/dt;
+    double msgs   = double(s.msgs - last.msgs)/dt;
+    double frames = double((s.frames - last.frames) & 0xffffff)/dt;
+    uint32_t drops = (s.drops - last.drops) & 0xffffff;
+
+    if (lVerbose)
+      printf("%8.0f pass/s %8.0f poll/s %10.0f msg/s %10.0f frames/s %6u drops  holdoff %3llu us  thr %#x\n",
+             passes, double(s.pollPass - last.pollPass)/dt, msgs, frames, drops,
+             (unsigned long long)holdoff, s.thr);
+
+    //  Interrupt holdoff
+    uint64_t h = holdoff;
+    const char* why = 0;
+    if (drops && holdoff) {
+      h = holdoff/2;
+      why = "drops";
+    }
+    else if (passes > target*1.1 && holdoff < budget) {
+      h = std::min<uint64_t>(budget, holdoff ? holdoff*2 : holdStep);
+      why = "pass rate above target";
+    }
+    else if (passes < target/2 && holdoff) {
+      h = holdoff/2;
+      why = "pass rate below target";
+    }
+    if (h && h < holdStep)
+      h = 0;
+    if (h != holdoff) {
+      logmsg("irq_holdoff_us %llu -> %llu: %s (%.0f pass/s, %.0f msg/s, %u drops)",
+             (unsigned long long)holdoff, (unsigned long long)h, why, passes, msgs, drops);
+      if (lDry || writeU64(holdoffAttr, h))
+        holdoff = h;
+      else
+        logmsg("failed to write %s: %m", holdoffAttr.c_str());
+    }
+
+    //  Firmware pause threshold
+    unsigned t = s.thr;
+    why = 0;
+    if (drops) {
+      quiet = 0;
+      if (s.thr < thrHi) {
+        t = std::min(thrHi, s.thr + thrUp);
+        why = "drops";
+      }
+    }
+    else if (++quiet >= quietN && s.thr > thrLo) {
+      t = std::max(thrLo, s.thr > thrDown ? s.thr - thrDown : 0);
+      why = "quiet";
+      quiet = 0;
+    }
+    else if (s.thr < thrLo || s.thr > thrHi) {
+      t = std::min(thrHi, std::max(thrLo, s.thr));
+      why = "out of bounds";
+    }
+    if (t != s.thr) {
+      logmsg("dmaFullThr %#x -> %#x: %s (%.0f frames/s, %u drops)",
+             s.thr, t, why, frames, drops);
+      if (!lDry && !writeU64(thrAttr, t))
+        logmsg("failed to write %s: %m", thrAttr.c_str());
+    }
+
+    last = s;
+  }
+
+  return 0;
+}
@@ -35,8 +35,18 @@
 #include <asm/atomic.h>
 #include <linux/cdev.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/dma-mapping.h>
+#include <linux/eventfd.h>
+#include <linux/rculist.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/tsc.h>
 #include "tpr.h"
 
+#define CREATE_TRACE_POINTS
+#include "tpr_trace.h"
+
 /**
  * HAVE_UNLOCKED_IOCTL has been dropped in kernel version 5.9.
  * There is a chance that the removal might be ported back to 5.x.
@@ -130,6 +140,82 @@ MODULE_DEVICE_TABLE(pci, tpr_ids);
 module_init(tpr_init);
 module_exit(tpr_exit);
 
+// Max number of DMA buffers handled per tasklet pass (0 = drain the ring)
+static uint dma_budget = 64;
+module_param(dma_budget, uint, 0644);
+MODULE_PARM_DESC(dma_budget, "DMA buffers processed per pass before yielding (0=unlimited)");
+
+// Interrupt holdoff: after a pass that handled buffers, look again this much
+// later instead of re-arming the interrupt, so buffers arriving meanwhile
+// share one pass.  Trades latency for interrupt rate.  This is the default
+// of each card's irq_holdoff_us sysfs attribute, which tprtune sets.
+static uint irq_holdoff_us = 0;
+module_param(irq_holdoff_us, uint, 0444);
+MODULE_PARM_DESC(irq_holdoff_us, "Default delay before re-polling after a pass with buffers, in place of re-arming the interrupt [us] (0=off); per card in sysfs");
+
+// Also copy each EVENT into a private queue for every channel in its mask
+static int chan_queues = 0;
+module_param(chan_queues, int, 0444);
+MODULE_PARM_DESC(chan_queues, "Maintain a contiguous copy queue per channel (mapped at hdr.chnqOffset)");
+
+// Skip the per-channel indices; consumers scan the tag words instead
+static int index_free = 0;
+module_param(index_free, int, 0444);
+MODULE_PARM_DESC(index_free, "Publish the tag word of each allq position (hdr.allmaskOffset) in place of the per-channel allrp indices");
+
+// Also publish a 32-byte summary of each allq position
+static int compact_queue = 0;
+module_param(compact_queue, int, 0444);
+MODULE_PARM_DESC(compact_queue, "Maintain a compact ring of pulse id, timestamp, tag and tsc beside allq (mapped at hdr.compactOffset)");
+
+// Queue depths, rounded up to a power of two
+static uint allq_depth = MAX_TPR_ALLQ;
+module_param(allq_depth, uint, 0444);
+MODULE_PARM_DESC(allq_depth, "Entries in the master event queue and each channel index");
+
+static uint bsaq_depth = MAX_TPR_BSAQ;
+module_param(bsaq_depth, uint, 0444);
+MODULE_PARM_DESC(bsaq_depth, "Entries in the BSA queue");
+
+static uint chnq_depth = MAX_TPR_CHNQ;
+module_param(chnq_depth, uint, 0444);
+MODULE_PARM_DESC(chnq_depth, "Entries in each channel copy queue (chan_queues=1)");
+
+// Publish descriptors into the rx buffers instead of copying messages
+static int zero_copy = 0;
+module_param(zero_copy, int, 0444);
+MODULE_PARM_DESC(zero_copy, "Publish zero-copy descriptors (zcq/zcbsaq) in place of allq/bsaq");
+
+static uint filt_depth = 4096;
+module_param(filt_depth, uint, 0444);
+MODULE_PARM_DESC(filt_depth, "Entries in each open's filtered index (TPR_IOC_FILTER)");
+
+static uint tsc_cal_ms = 1000;
+module_param(tsc_cal_ms, uint, 0444);
+MODULE_PARM_DESC(tsc_cal_ms, "Interval between refreshes of the tsc calibration in the queue header [ms]");
+
+static uint zc_hold_max = 0;
+module_param(zc_hold_max, uint, 0644);
+MODULE_PARM_DESC(zc_hold_max, "Max rx buffers held for zero-copy readers before forcing recycle (0=half)");
+
+// Rx buffer pool
+static uint rx_buffers = NUMBER_OF_RX_BUFFERS;
+module_param(rx_buffers, uint, 0444);
+MODULE_PARM_DESC(rx_buffers, "Number of DMA rx buffers (16-1023)");
+
+static uint rx_buf_size = BUF_SIZE;
+module_param(rx_buf_size, uint, 0444);
+MODULE_PARM_DESC(rx_buf_size, "Size of each DMA rx buffer, rounded up to a power of two (512B-1MB, capped at KMALLOC_MAX_SIZE/16: 256KB on x86)");
+
+// Flight recorder (debugfs flight)
+static uint flight_buffers = 0;
+module_param(flight_buffers, uint, 0444);
+MODULE_PARM_DESC(flight_buffers, "Raw rx buffers kept by the flight recorder (0=off)");
+
+static uint flight_bytes = 1024;
+module_param(flight_bytes, uint, 0444);
+MODULE_PARM_DESC(flight_bytes, "Bytes kept from the head of each rx buffer by the flight recorder");
+
 
 // PCI driver structure
 static struct pci_driver tprDriver = {
@@ -168,34 +254,299 @@ static struct vm_operations_struct tpr_vmops = {
 
 static int allocBar(struct bar_dev* minor, int major, struct pci_dev* dev, int bar);
 
+static struct dentry* tpr_debugfs;
+
 #ifdef TPRDEBUG
-static void printList(struct shared_tpr *sh)
+static void printList(struct list_head *head)
 {
     struct shared_tpr *shared;
-    for (shared = sh; shared && shared->next!=shared; shared=shared->next)
-        printk(KERN_WARNING "%s         %d [%p %p %p]\n", MOD_NAME, shared->idx, shared, shared->next, shared->prev);
+    list_for_each_entry(shared, head, list)
+        printk(KERN_WARNING "%s         %d [%p]\n", MOD_NAME, shared->idx, shared);
 }
 #endif
 
+// The rx buffer the hardware fills after rxb
+static inline struct RxBuffer* tpr_rx_next(struct tpr_dev* dev, struct RxBuffer* rxb)
+{
+  return rxb->idx+1 < dev->rxCount ? rxb+1 : dev->rxBuffer;
+}
+
+// Return held rx buffers to the hardware once every zero-copy reader has
+// released them.  Readers that fall more than zc_hold_max buffers behind
+// lose theirs; they see it through zcfree.  Called with dev->zcLock held.
+static void tpr_zc_recycle(struct tpr_dev* dev)
+{
+  struct TprQueues* tprq = dev->amem;
+  struct RxBuffer*  next = dev->rxHold;
+  u64               epoch = dev->zcEpoch;
+  u64               hold  = zc_hold_max && zc_hold_max < dev->rxCount ? zc_hold_max : dev->rxCount/2;
+  int               i;
+
+  if (dev->zcReaders) {
+    for (i = 0; i < OPEN_SHARES; i++) {
+      if (dev->all_shares[i].zcReader && dev->all_shares[i].zcEpoch < epoch)
+        epoch = dev->all_shares[i].zcEpoch;
+    }
+  }
+
+  if (dev->zcEpoch - epoch > hold) {
+    dev->zcForced += (dev->zcEpoch - hold) - epoch;
+    epoch = dev->zcEpoch - hold;
+  }
+
+  if (epoch <= dev->zcFree)
+    return;
+
+  //  Publish before the hardware can overwrite anything
+  tprq->zcfree = epoch;
+  wmb();
+
+  while (dev->zcFree < epoch) {
+    trace_tpr_rx_free(dev, next);
+    ((struct TprReg*)dev->bar[0].reg)->rxFree[0] = next->dma;
+    next = tpr_rx_next(dev, next);
+    dev->zcFree++;
+  }
+  dev->rxHold = next;
+}
+
+static long tpr_zc_release(struct shared_tpr *shared, unsigned long arg)
+{
+  struct tpr_dev *dev = shared->parent;
+  __u64 epoch;
+
+  if (!shared->zcReader)
+    return -EINVAL;
+
+  if (copy_from_user(&epoch, (void __user *)arg, sizeof(epoch)))
+    return -EFAULT;
+
+  spin_lock_bh(&dev->zcLock);
+  if (epoch > shared->zcEpoch && epoch <= dev->zcEpoch)
+    shared->zcEpoch = epoch;
+  tpr_zc_recycle(dev);
+  spin_unlock_bh(&dev->zcLock);
+
+  return SUCCESS;
+}
+
+// Register (fd >= 0) or drop (fd < 0) the eventfd signalled at each wakeup
+static long tpr_set_eventfd(struct shared_tpr *shared, unsigned long arg)
+{
+  struct eventfd_ctx *efd = NULL, *old;
+  int fd;
+
+  if (shared->idx < 0)
+    return -EINVAL;
+
+  if (copy_from_user(&fd, (void __user *)arg, sizeof(fd)))
+    return -EFAULT;
+
+  if (fd >= 0) {
+    efd = eventfd_ctx_fdget(fd);
+    if (IS_ERR(efd))
+      return PTR_ERR(efd);
+  }
+
+  spin_lock_bh(&shared->lock);
+  old = shared->efd;
+  shared->efd = efd;
+  spin_unlock_bh(&shared->lock);
+
+  if (old)
+    eventfd_ctx_put(old);
+
+  return SUCCESS;
+}
+
+// Set the wakeup coalescing thresholds of this open
+static long tpr_set_coalesce(struct shared_tpr *shared, unsigned long arg)
+{
+  struct tpr_dev *dev = shared->parent;
+  struct tpr_coalesce c;
+  int was;
+
+  if (shared->idx < 0)
+    return -EINVAL;
+
+  if (copy_from_user(&c, (void __user *)arg, sizeof(c)))
+    return -EFAULT;
+
+  //  Under the lock that release takes to drop this open from coalescers
+  spin_lock(&dev->lock);
+  was = shared->wakeMin || shared->wakeDelay;
+  shared->wakeMin   = c.minEntries;
+  shared->wakeDelay = (u64)c.maxDelayUs * 1000;
+  dev->coalescers += (c.minEntries || c.maxDelayUs) - was;
+  spin_unlock(&dev->lock);
+
+  return SUCCESS;
+}
+
+// Set the event filter of a channel open.  The first call gives the open
+// its filtered index, which it keeps until it is closed.
+static long tpr_set_filter(struct shared_tpr *shared, unsigned long arg)
+{
+  struct tpr_dev *dev = shared->parent;
+  struct TprFiltQueue *filt = NULL, *spare = NULL;
+  struct tpr_filter f;
+
+  if (shared->idx < 0 || shared->minor < 0)
+    return -EINVAL;
+
+  if (dev->dmx.allmask)      // filtered indices are fed by the channel indexing
+    return -EOPNOTSUPP;
+
+  if (copy_from_user(&f, (void __user *)arg, sizeof(f)))
+    return -EFAULT;
+
+  if (f.modulo && f.phase >= f.modulo)
+    return -EINVAL;
+
+  if (!shared->filt) {
+    filt = vmalloc_user(sizeof(struct TprFiltQueue) + (dev->filtMask+1)*sizeof(long long));
+    if (!filt)
+      return -ENOMEM;
+  }
+
+  //  Keep the dma tasklet out while the filter changes.  The lock orders
+  //  this against another FILTER on the open and against release, which
+  //  also count filters under it.
+  tasklet_disable(&dev->dma_task);
+  spin_lock(&dev->lock);
+  if (filt && shared->filt) {   // another call installed one first
+    spare = filt;
+    filt  = NULL;
+  }
+  if (filt) {
+    shared->filt     = filt;
+    shared->filtWake = 0;
+    dev->filters++;
+  }
+  shared->filter     = f;
+  shared->decimCount = 0;
+  spin_unlock(&dev->lock);
+  tasklet_enable(&dev->dma_task);
+
+  if (spare)
+    vfree(spare);
+
+  //  A batched reader now walks the filtered index
+  if (filt) {
+    mutex_lock(&shared->readLock);
+    shared->readRp = 0;
+    mutex_unlock(&shared->readLock);
+  }
+
+  return SUCCESS;
+}
+
+//  The stream a TPR_READ_ENTRIES open walks: the BSA queue, the open's
+//  filtered index, the channel's allrp index, or with index_free every allq
+//  position, skipping those without the channel's bit.
+static inline long long tpr_read_wp(struct shared_tpr *shared)
+{
+  struct TprQueues *tprq = (struct TprQueues*)shared->parent->amem;
+
+  if (shared->minor < 0)
+    return smp_load_acquire(&tprq->bsawp);
+  if (shared->filt)
+    return smp_load_acquire(&shared->filt->fwp);
+  if (shared->parent->dmx.allmask)
+    return smp_load_acquire(&tprq->gwp);
+  return smp_load_acquire(&tprq->allwp[shared->minor]);
+}
+
+static inline int tpr_read_skip(struct shared_tpr *shared, long long rp)
+{
+  struct tpr_demux *d = &shared->parent->dmx;
+
+  return d->allmask && shared->minor >= 0 &&
+    !(READ_ONCE(d->allmask[rp & d->allqMask]) & (1U << shared->minor));
+}
+
+static inline long long tpr_read_depth(struct shared_tpr *shared)
+{
+  struct tpr_dev *dev = shared->parent;
+
+  if (shared->minor < 0)
+    return dev->dmx.bsaqMask+1;
+  if (shared->filt)
+    return dev->filtMask+1;
+  return dev->dmx.allqMask+1;
+}
+
+// The entry at stream position rp, and the queue position it should hold
+static inline struct TprEntry* tpr_read_entry(struct shared_tpr *shared, long long rp, long long *pos)
+{
+  struct tpr_dev *dev = shared->parent;
+
+  if (shared->minor < 0) {
+    *pos = rp;
+    return &dev->dmx.bsaq[rp & dev->dmx.bsaqMask];
+  }
+  if (shared->filt)
+    *pos = READ_ONCE(shared->filt->fidx[rp & dev->filtMask]);
+  else if (dev->dmx.allmask)
+    *pos = rp;
+  else
+    *pos = READ_ONCE(tpr_allrp(&dev->dmx, shared->minor)[rp & dev->dmx.allqMask]);
+  return &dev->dmx.allq[*pos & dev->dmx.allqMask];
+}
+
+// Select what read() returns for this open
+static long tpr_set_readmode(struct shared_tpr *shared, unsigned long arg)
+{
+  int mode;
+
+  if (shared->idx < 0)
+    return -EINVAL;
+
+  if (copy_from_user(&mode, (void __user *)arg, sizeof(mode)))
+    return -EFAULT;
+
+  if (mode != TPR_READ_PENDING && mode != TPR_READ_ENTRIES)
+    return -EINVAL;
+
+  if (mode == TPR_READ_ENTRIES && shared->parent->dmx.zc)
+    return -EOPNOTSUPP;
+
+  mutex_lock(&shared->readLock);
+  shared->readMode = mode;
+  shared->readRp   = tpr_read_wp(shared);
+  shared->readLost = 0;
+  mutex_unlock(&shared->readLock);
+
+  return SUCCESS;
+}
+
 // Open Returns 0 on success, error code on failure
 int tpr_open(struct inode *inode, struct file *filp) {
   struct tpr_dev *   dev;
   struct TprReg*     reg;
-  int                minor;
+  int                minor, chan;
 
   // Extract structure for card
   dev = container_of(inode->i_cdev, struct tpr_dev, cdev);
   minor = iminor(inode);
+  chan  = tpr_minor_channel(minor);
 
   printk(KERN_WARNING "%s: Open: Minor %i.  Maj %i\n",
 	 MOD_NAME, minor, dev->major);
 
-  if (minor < MOD_SHARED || minor == (MOD_SHARED+1)) { // A single channel or BSA
+  if (chan >= (int)dev->nchan) {
+    printk(KERN_WARNING "%s: Open: module open failed.  Firmware has %u channels. Maj=%i, Min=%i.\n",
+           MOD_NAME, dev->nchan, dev->major, (unsigned)minor);
+    return -ENODEV;
+  }
+
+  if (chan >= 0 || minor == (MOD_SHARED+1)) { // A single channel or BSA
     struct shared_tpr *shared;
+    int first;
     spin_lock(&dev->lock);
-    shared = dev->freelist;
+    shared = list_first_entry_or_null(&dev->freelist, struct shared_tpr, list);
     if (shared)
-        dev->freelist = shared->next;
+        list_del(&shared->list);
     spin_unlock(&dev->lock);
     if (!shared) {
       printk(KERN_WARNING "%s: Open: module open failed.  Too many opens. Maj=%i, Min=%i.\n",
@@ -204,50 +555,57 @@ int tpr_open(struct inode *inode, struct file *filp) {
     }
     filp->private_data = shared;
     shared->parent = dev;
+    shared->efd    = NULL;
+    shared->wakeMin   = 0;
+    shared->wakeDelay = 0;
+    shared->pending   = 0;
+    shared->filt      = NULL;
+    shared->readMode  = TPR_READ_PENDING;
 #ifdef TPRDEBUG
     printk(KERN_WARNING "%s: Open: minor %d opened as index %d.\n",
            MOD_NAME, minor, shared->idx);
 #endif
 
-    if (minor < MOD_SHARED) {
-        if (!dev->shared[minor]) {  // The first open for this minor device.
+    if (chan >= 0) {
+        shared->minor = chan;
+        spin_lock(&dev->lock);
+        first = list_empty(&dev->shared[chan]);
+        if (first) {
+            memset(&((struct TprQueues*)dev->amem)->chstat[chan], 0, sizeof(struct TprChStats));
+            //  Under the lock, as release clears it; the tasklet reads it
+            WRITE_ONCE(dev->dmx.minors, dev->dmx.minors | (1<<chan));
+        }
+        list_add_rcu(&shared->list, &dev->shared[chan]);
+        spin_unlock(&dev->lock);
+
+        if (first) {  // The first open for this minor device.
             printk(KERN_WARNING "%s: Open: Enable minor. Maj=%i, Min=%i.\n",
                    MOD_NAME, dev->major, (unsigned)minor);
-            dev->minors = dev->minors | (1<<minor);
             //
             //  Enable the dma for this channel
             //
             reg = (struct TprReg*)(dev->bar[0].reg);
-            reg->channel[minor].control = reg->channel[minor].control | (1<<2);
+            reg->channel[chan].control = reg->channel[chan].control | (1<<2);
             reg->irqControl = 1;
             dev->irqEnable++;
         }
-        shared->minor = minor;
-        spin_lock(&dev->lock);
-        shared->next = dev->shared[minor];
-        if (shared->next)
-            shared->next->prev = shared;
-        shared->prev = NULL;
-        dev->shared[minor] = shared;
-        spin_unlock(&dev->lock);
 #ifdef TPRDEBUG
-        printk(KERN_WARNING "%s         dev->shared[%d]\n", MOD_NAME, minor);
-        printList(dev->shared[minor]);
+        printk(KERN_WARNING "%s         dev->shared[%d]\n", MOD_NAME, chan);
+        printList(&dev->shared[chan]);
 #endif
     }
     else if (minor == MOD_SHARED+1) {
         shared->minor = -1;
         spin_lock(&dev->lock);
-        shared->next = dev->bsa;
-        if (shared->next)
-            shared->next->prev = shared;
-        shared->prev = NULL;
-        dev->bsa = shared;
+        if (list_empty(&dev->bsa))
+            memset(&((struct TprQueues*)dev->amem)->bsastat, 0, sizeof(struct TprChStats));
+        list_add_rcu(&shared->list, &dev->bsa);
+        dev->dmx.bsaOpen = 1;
         spin_unlock(&dev->lock);
 #ifdef TPRDEBUG
         printk(KERN_WARNING "%s: BSA list. Maj=%i, Min=%i.\n",
                MOD_NAME, dev->major, (unsigned)shared->minor);
-        printList(dev->bsa);
+        printList(&dev->bsa);
 #endif
     }
   }
@@ -286,65 +644,90 @@ int tpr_release(struct inode *inode, struct file *filp) {
   }
 
   dev = (struct tpr_dev*)shared->parent;
+
+  if (shared->zcReader) {                     // Let go of any held rx buffers
+    spin_lock_bh(&dev->zcLock);
+    shared->zcReader = 0;
+    dev->zcReaders--;
+    tpr_zc_recycle(dev);
+    spin_unlock_bh(&dev->zcLock);
+  }
+
   if (shared->idx < 0) {                      // Master
       // Nothing to do!
   }
   else {                                      // Single channel or BSA
     spin_lock(&dev->lock);
-    if (shared->prev)
-        shared->prev->next = shared->next;
-    if (shared->next)
-        shared->next->prev = shared->prev;
+    list_del_rcu(&shared->list);
 
     if (shared->minor < 0) {
-        if(!shared->prev) dev->bsa = shared->next;
+        dev->dmx.bsaOpen = !list_empty(&dev->bsa);
 #ifdef TPRDEBUG
         printk(KERN_WARNING "%s: BSA list. Maj=%i, Min=%i.\n",
                MOD_NAME, dev->major, (unsigned)shared->minor);
-        printList(dev->bsa);
+        printList(&dev->bsa);
 #endif
     } else {                 // Single channel
-        if(!shared->prev) dev->shared[shared->minor] = shared->next;
-        if (!dev->shared[shared->minor]) {       // Last one leaving, shut out the lights...
+        if (list_empty(&dev->shared[shared->minor])) {       // Last one leaving, shut out the lights...
           i = shared->minor;
           reg = (struct TprReg*)shared->parent->bar[0].reg;
           reg->channel[i].control = reg->channel[0].control & ~(1<<2);
-          dev->minors = dev->minors & ~(1<<i);
+          WRITE_ONCE(dev->dmx.minors, dev->dmx.minors & ~(1<<i));
           printk(KERN_WARNING "%s: Release: Disable minor. Maj=%i, Min=%i.\n",
                  MOD_NAME, dev->major, (unsigned)shared->minor);
         }
 #ifdef TPRDEBUG
         printk(KERN_WARNING "%s         dev->shared[%d]\n", MOD_NAME, shared->minor);
-        printList(dev->shared[shared->minor]);
+        printList(&dev->shared[shared->minor]);
 #endif
     }
 
-    //  Put it back on the freelist
-    shared->prev = NULL;
-    if (dev->freelist) {
-      shared->next = dev->freelist;
+    if (shared->wakeMin || shared->wakeDelay)
+      dev->coalescers--;
+    if (shared->filt)
+      dev->filters--;
+
+    spin_unlock(&dev->lock);
+
+    //  Off the list; wait until the tasklet can no longer be looking at it
+    synchronize_rcu();
+
+    if (shared->filt) {
+      vfree(shared->filt);
+      shared->filt = NULL;
     }
-    else {
-      shared->next = NULL;
+    if (shared->efd) {
+      eventfd_ctx_put(shared->efd);
+      shared->efd = NULL;
     }
-    dev->freelist = shared;
 
+    //  Put it back on the freelist
+    spin_lock(&dev->lock);
+    list_add(&shared->list, &dev->freelist);
     spin_unlock(&dev->lock);
   }
 
-  printk("%s: Release: Major %u: irqEnable %u, irqDisable %u, irqCount %u, irqNoReq %u\n",
+#ifdef TPRDEBUG
+  printk("%s: Release: Major %u: irqEnable %llu, irqDisable %llu, irqCount %llu, irqNoReq %llu\n",
 	   MOD_NAME, shared->parent->major,
 	   dev->irqEnable,
 	   dev->irqDisable,
 	   dev->irqCount,
 	   dev->irqNoReq);
 
-  printk("%s: Release: Major %u: dmaCount %u, dmaEvent %u, dmaBsaChan %u, dmaBsaCtrl %u\n",
+  printk("%s: Release: Major %u: dmaCount %llu, dmaEvent %llu, dmaBsaChan %llu, dmaBsaCtrl %llu\n",
 	   MOD_NAME, shared->parent->major,
-	   dev->dmaCount,
-	   dev->dmaEvent,
-	   dev->dmaBsaChan,
-	   dev->dmaBsaCtrl);
+	   dev->dmx.dmaCount,
+	   dev->dmx.dmaEvent,
+	   dev->dmx.dmaBsaChan,
+	   dev->dmx.dmaBsaCtrl);
+
+  printk("%s: Release: Major %u: dmaIrqPass %llu, dmaPollPass %llu, zcForced %llu\n",
+	   MOD_NAME, shared->parent->major,
+	   dev->dmaIrqPass,
+	   dev->dmaPollPass,
+	   dev->zcForced);
+#endif
 
   //  Unlink
   shared->parent = NULL;
@@ -360,14 +743,118 @@ ssize_t tpr_write(struct file *filp, const char *buffer, size_t count, loff_t *f
 }
 
 
+// Copy entries from the cursor, then the trailer (TPR_READ_ENTRIES).
+// Each entry is checked against its seq after the copy, as a mapped reader
+// would; entries the writer has lapped are skipped and counted as lost.
+static ssize_t tpr_read_entries(struct shared_tpr *shared, char __user *buffer, size_t count, int nonblock)
+{
+  struct TprQueues *tprq = (struct TprQueues*)shared->parent->amem;
+  struct tpr_read_trailer tr;
+  struct TprEntry *entry;
+  size_t n = 0, max;
+  long long rp, wp, pos, depth;
+  u64 lost;
+
+  if (count < sizeof(struct TprEntry) + sizeof(tr))
+    return -EINVAL;
+  max = (count - sizeof(tr)) / sizeof(struct TprEntry);
+
+  if (mutex_lock_interruptible(&shared->readLock))
+    return -ERESTARTSYS;
+
+  //  Clear the wakeup before looking, so none is lost; coalescing still
+  //  decides when a blocked reader wakes
+again:
+  while (1) {
+    clear_bit(0, &shared->pendingirq);
+    wp = tpr_read_wp(shared);
+    if (wp != shared->readRp)
+      break;
+    mutex_unlock(&shared->readLock);
+    if (nonblock)
+      return -EAGAIN;
+    if (wait_event_interruptible(shared->waitq, shared->pendingirq))
+      return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&shared->readLock))
+      return -ERESTARTSYS;
+  }
+
+  depth = tpr_read_depth(shared);
+  rp    = shared->readRp;
+  lost  = shared->readLost;
+
+  //  As in tpr_queues.h, slot rp is only good while wp - rp < depth: at
+  //  depth it is the one the writer fills next, before it moves wp
+  while (n < max && rp < wp) {
+    if (wp - rp >= depth) {        // lapped: resume at the oldest good slot
+      shared->readLost += wp - depth + 1 - rp;
+      rp = wp - depth + 1;
+    }
+    if (tpr_read_skip(shared, rp)) {
+      rp++;
+      continue;
+    }
+    entry = tpr_read_entry(shared, rp, &pos);
+    if (smp_load_acquire(&entry->seq) == pos) {
+      if (copy_to_user(buffer + n*sizeof(*entry), entry, sizeof(*entry))) {
+        mutex_unlock(&shared->readLock);
+        return -EFAULT;
+      }
+      smp_rmb();
+      if (READ_ONCE(entry->seq) == pos) {
+        wp = tpr_read_wp(shared);  // the index slot is still good?
+        if (wp - rp >= depth)
+          continue;
+        n++;
+        rp++;
+        continue;
+      }
+    }
+    //  The entry itself was rewritten (allq wraps ahead of a sparse index)
+    shared->readLost++;
+    rp++;
+    wp = tpr_read_wp(shared);
+  }
+
+  //  Index-free: none of the new positions were for this channel
+  if (!n && rp == wp && lost == shared->readLost) {
+    shared->readRp = rp;
+    goto again;
+  }
+
+  shared->readRp = rp;
+  if (rp != wp)                    // more to read; keep poll() readable
+    set_bit(0, &shared->pendingirq);
+
+  memset(&tr, 0, sizeof(tr));
+  tr.entries = n;
+  tr.rp      = rp;
+  tr.wp      = wp;
+  tr.lost    = shared->readLost;
+  tr.drops   = shared->minor < 0 ? tprq->bsastat.drops : tprq->chstat[shared->minor].drops;
+  mutex_unlock(&shared->readLock);
+
+  if (copy_to_user(buffer + n*sizeof(*entry), &tr, sizeof(tr)))
+    return -EFAULT;
+
+  return n*sizeof(*entry) + sizeof(tr);
+}
+
 // tpr_read
-// Returns bit mask of queues with data pending.
+// Returns bit mask of queues with data pending, or entries (TPR_IOC_READMODE).
 ssize_t tpr_read(struct file *filp, char *buffer, size_t count, loff_t *f_pos)
 {
   ssize_t retval = 0;
   struct shared_tpr *shared = ((struct shared_tpr *) filp->private_data);
   __u32 pendingirq;
 
+  if (shared->idx >= 0 && shared->readMode == TPR_READ_ENTRIES) {
+    retval = tpr_read_entries(shared, buffer, count, filp->f_flags & O_NONBLOCK);
+    if (retval > 0)
+      *f_pos = *f_pos + retval;
+    return retval;
+  }
+
   do {
     if (count < sizeof(pendingirq))
       break;
@@ -403,7 +890,22 @@ long tpr_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 int tpr_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg) {
 #endif
 
-  // lcls-i ioctls only?
+  struct shared_tpr *shared = (struct shared_tpr *)filp->private_data;
+
+  switch (cmd) {
+  case TPR_IOC_ZC_RELEASE:
+    return tpr_zc_release(shared, arg);
+  case TPR_IOC_EVENTFD:
+    return tpr_set_eventfd(shared, arg);
+  case TPR_IOC_COALESCE:
+    return tpr_set_coalesce(shared, arg);
+  case TPR_IOC_FILTER:
+    return tpr_set_filter(shared, arg);
+  case TPR_IOC_READMODE:
+    return tpr_set_readmode(shared, arg);
+  default:
+    break;
+  }
 
   return(ERROR);
 }
@@ -418,7 +920,245 @@ long tpr_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 }
 #endif
 
+// The copy queue of channel ich (chan_queues=1)
+static inline struct TprChQueue* tpr_chnq(struct tpr_dev* dev, uint ich)
+{
+  return (struct TprChQueue*)(dev->cmem + ich*dev->chnqSize);
+}
+
+static inline void tpr_hist_add(struct tpr_hist* h, u64 v)
+{
+  h->bin[min(fls64(v), TPR_HIST_BINS-1)]++;
+}
+
+static inline struct tpr_flight* tpr_flight_at(struct tpr_dev* dev, u64 seq)
+{
+  return dev->flight + (size_t)(seq % dev->flightCount) * dev->flightStride;
+}
+
+// Keep a copy of the buffer about to be parsed, before anything rewrites it
+static void tpr_flight_record(struct tpr_dev* dev, struct RxBuffer* buf, __u64 tsc)
+{
+  struct tpr_flight* f = tpr_flight_at(dev, dev->flightSeq);
+
+  WRITE_ONCE(f->seq, TPR_SEQ_BUSY);
+  smp_wmb();
+  f->tsc        = tsc;
+  f->idx        = buf->idx;
+  f->bytes      = dev->flightStride - sizeof(*f);
+  f->irqCount   = dev->irqCount;
+  f->dmaCount   = dev->dmx.dmaCount;
+  f->dmaEvent   = dev->dmx.dmaEvent;
+  f->dmaErrors  = dev->dmx.dmaErrors;
+  f->dmaBsaChan = dev->dmx.dmaBsaChan;
+  f->dmaBsaCtrl = dev->dmx.dmaBsaCtrl;
+  memcpy(f->data, buf->buffer, f->bytes);
+  smp_store_release(&f->seq, dev->flightSeq);
+  dev->flightSeq++;
+}
+
+static void tpr_flight_freeze(struct tpr_dev* dev, int why, __u32* dptr, struct RxBuffer* buf)
+{
+  if (!dev->flight || dev->flightFrozen)
+    return;
+  dev->flightFrozen = why;
+  dev->flightWord   = dptr[0];
+  dev->flightOffset = (unchar*)dptr - buf->buffer;
+  printk(KERN_WARNING "%s: flight recorder frozen at rx buffer %llu\n", MOD_NAME, dev->flightSeq-1);
+}
+
+// Fill a zero-copy descriptor for the message at dptr (NULL rxb for markers)
+static inline void tpr_zc_desc(struct TprZcDesc* desc, long long pos, struct tpr_dev* dev,
+                               struct RxBuffer* rxb, __u32* dptr, __u64 tsc)
+{
+  WRITE_ONCE(desc->seq, TPR_SEQ_BUSY);
+  smp_wmb();
+  desc->buf      = rxb ? rxb->idx : ~0U;
+  desc->offset   = rxb ? (unchar*)dptr - rxb->buffer : 0;
+  desc->tag      = dptr[0];
+  desc->epoch    = dev->zcEpoch;
+  desc->fifo_tsc = tsc;
+  smp_store_release(&desc->seq, pos);
+}
+
+// Does an EVENT pass the filter of this open
+static inline int tpr_filter_pass(struct shared_tpr* shared, __u32* dptr)
+{
+  struct tpr_filter* f = &shared->filter;
+  __u64 pid;
+  __u32 breq, dest;
+
+  if (f->modulo) {
+    pid = ((__u64)dptr[EVENT_PULSEID_WORD+1] << 32) | dptr[EVENT_PULSEID_WORD];
+    if (do_div(pid, f->modulo) != f->phase)
+      return 0;
+  }
+  if (f->destMask) {
+    breq = dptr[EVENT_BEAMREQ_WORD];
+    dest = (breq & 1) ? 1 << ((breq >> 4) & 0xf) : TPR_FILTER_NOBEAM;
+    if (!(f->destMask & dest))
+      return 0;
+  }
+  if (f->decimate > 1) {
+    if (++shared->decimCount < f->decimate)
+      return 0;
+    shared->decimCount = 0;
+  }
+  return 1;
+}
+
+// Index allq position pos into the filtered streams of channel ich.
+// Drop markers (dptr NULL) go into all of them.
+static void tpr_filter_index(struct tpr_dev* dev, __u32 ich, long long pos, __u32* dptr)
+{
+  struct shared_tpr   *shared;
+  struct TprFiltQueue *filt;
+
+  list_for_each_entry_rcu(shared, &dev->shared[ich], list) {
+    filt = shared->filt;
+    if (filt && (!dptr || tpr_filter_pass(shared, dptr))) {
+      filt->fidx[filt->fwp & dev->filtMask] = pos;
+      smp_store_release(&filt->fwp, filt->fwp+1);
+    }
+  }
+}
+
+//  Hooks of the demux core (tpr_demux.h)
+static inline void tpr_demux_zc(struct tpr_demux* d, int bsa, long long pos,
+                                __u32* dptr, __u64 tsc, void* buf)
+{
+  struct tpr_dev* dev = container_of(d, struct tpr_dev, dmx);
+
+  if (bsa)
+    tpr_zc_desc(&dev->zcbsaq[pos & d->bsaqMask], pos, dev, buf, dptr, tsc);
+  else
+    tpr_zc_desc(&dev->zcq[pos & d->allqMask], pos, dev, buf, dptr, tsc);
+}
+
+static inline void tpr_demux_indexed(struct tpr_demux* d, unsigned ich, long long pos,
+                                     __u32* dptr, size_t sz, __u64 tsc)
+{
+  struct tpr_dev* dev = container_of(d, struct tpr_dev, dmx);
+  struct TprChQueue* chq;
+
+  if (dev->filters)
+    tpr_filter_index(dev, ich, pos, ((dptr[0]>>16)&0xf) == DROP_TAG ? NULL : dptr);
+  if (dev->cmem && (d->minors & (1<<ich))) {
+    chq = tpr_chnq(dev, ich);
+    tpr_entry_write(&chq->chnq[chq->chnwp & dev->chnqMask], chq->chnwp, dptr, sz, tsc);
+    smp_store_release(&chq->chnwp, chq->chnwp+1);
+  }
+}
+
+static inline void tpr_demux_message(struct tpr_demux* d, long long pos, __u32* dptr, void* buf)
+{
+  trace_tpr_msg(container_of(d, struct tpr_dev, dmx), buf, dptr, pos);
+}
+
+static inline void tpr_demux_error(struct tpr_demux* d, int why, __u32* dptr, void* buf)
+{
+  struct tpr_dev* dev = container_of(d, struct tpr_dev, dmx);
+  struct RxBuffer* rxb = buf;
+
+  if (why == TPR_DEMUX_BADSIZE) {
+    if ((d->dmaErrors%1024)<4) {
+      printk(KERN_WARNING  "%s: unexpected event dma size %08x(%08x)...truncating.\n", MOD_NAME, EVENT_MSGSZ,(dptr[1]<<2)+8);
+      printk(KERN_WARNING  "  dptr %p  buffer %p  next %p\n",
+             dptr, rxb->buffer, tpr_rx_next(dev, rxb)->buffer);
+      printk(KERN_WARNING  "  dmaCount %llu  dmaEvent %llu  dmaErrors %llu\n",
+             d->dmaCount, d->dmaEvent, d->dmaErrors);
+    }
+  }
+  else
+    printk(KERN_WARNING  "%s: handle unknown msg %08x:%08x\n", MOD_NAME, dptr[0], dptr[1]);
+
+  tpr_flight_freeze(dev, why, dptr, rxb);
+}
+
+// Wake one client: read()/poll() waiters, and its eventfd if registered,
+// which is credited with the number of new entries.
+static inline void tpr_wake(struct shared_tpr *shared, __u64 count)
+{
+  trace_tpr_wake(shared, count);
+  tpr_hist_add(&shared->parent->histWake, local_clock() - shared->parent->wakeStamp);
+  set_bit(0, (volatile unsigned long*)&shared->pendingirq);
+  wake_up(&shared->waitq);
+  if (shared->efd) {
+    spin_lock(&shared->lock);
+    if (shared->efd)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+      eventfd_signal(shared->efd);  // count no longer carried; see the queue write pointers
+#else
+      eventfd_signal(shared->efd, count);
+#endif
+    spin_unlock(&shared->lock);
+  }
+}
+
+// Wake a client subject to its coalescing thresholds.  Entries held back
+// accumulate in shared->pending; *deadline collects the earliest time a
+// held wakeup is due.
+static inline void tpr_notify(struct shared_tpr *shared, __u64 count,
+                              __u64 now, __u64 *deadline)
+{
+  if (!shared->wakeMin && !shared->wakeDelay) {
+    count += shared->pending;
+    shared->pending = 0;
+    if (count)
+      tpr_wake(shared, count);
+    return;
+  }
+
+  if (count) {
+    if (!shared->pending)
+      shared->pendingSince = now;
+    shared->pending += count;
+  }
+
+  if (!shared->pending)
+    return;
+
+  if ((shared->wakeMin   && shared->pending >= shared->wakeMin) ||
+      (shared->wakeDelay && now - shared->pendingSince >= shared->wakeDelay)) {
+    tpr_wake(shared, shared->pending);
+    shared->pending = 0;
+  }
+  else if (shared->wakeDelay) {
+    __u64 due = shared->pendingSince + shared->wakeDelay;
+    if (!*deadline || due < *deadline)
+      *deadline = due;
+  }
+}
+
+// Held wakeups are evaluated by the tasklet
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+static void tpr_coalesce_timer(struct timer_list *t)
+{
+  struct tpr_dev *dev = container_of(t, struct tpr_dev, coalesceTimer);
+#else
+static void tpr_coalesce_timer(unsigned long arg)
+{
+  struct tpr_dev *dev = (struct tpr_dev *)arg;
+#endif
+  tasklet_schedule(&dev->dma_task);
+}
+
+// Holdoff over; the next pass re-arms the interrupt if it finds nothing
+static enum hrtimer_restart tpr_holdoff_timer(struct hrtimer *t)
+{
+  struct tpr_dev *dev = container_of(t, struct tpr_dev, holdoffTimer);
+
+  tasklet_schedule(&dev->dma_task);
+  return HRTIMER_NORESTART;
+}
+
 // Bottom half of IRQ Handler
+//   Handles at most dma_budget buffers per pass.  While the ring stays busy
+//   the tasklet reschedules itself with the interrupt still masked, and the
+//   interrupt is only re-armed once the ring is idle.  The firmware holds its
+//   request asserted while any buffer is outstanding, so nothing is lost by
+//   re-arming late.  With a holdoff set, a pass that found buffers is
+//   followed by another after the holdoff rather than by the interrupt.
 static void tpr_handle_dma(unsigned long arg)
 {
   struct tpr_dev* dev = &gDevices[arg];
@@ -426,131 +1166,147 @@ static void tpr_handle_dma(unsigned long arg)
 
   struct RxBuffer*  next;
   __u32*            dptr;
-  __u32             mtyp, ich, mch, wmask=0;
-  __u64             tsc;
-  struct TprEntry  *pEntry;
+  __u32             ich, wmask=0;
+  uint              budget, holdoff, nbuf=0, nmsg;
+  __u64             now, deadline, t0;
+
+  budget = dma_budget ? dma_budget : dev->rxCount;
+
+  t0 = local_clock();
+
+  //  Only the interrupt handler stamps irqStamp; a pass with the interrupt
+  //  armed and no stamp was scheduled by the coalescing timer
+  if (dev->dmaPolling == TPR_POLL_HOLDOFF)
+    dev->dmaHoldPass++;
+  else if (dev->dmaPolling)
+    dev->dmaPollPass++;
+  else if (dev->irqStamp)
+    dev->dmaIrqPass++;
+  else
+    dev->dmaTimerPass++;
+
+  if (dev->irqStamp) {
+    tpr_hist_add(&dev->histIrq, t0 - dev->irqStamp);
+    dev->irqStamp = 0;
+  }
 
   next = dev->rxPend;
 
+  //  The subscriber lists change under us; walk them under RCU
+  rcu_read_lock();
+
   //  Check the "dma done" bit.
-  while (test_and_clear_bit(31, (volatile unsigned long*)next->buffer)) {
+  while (nbuf < budget &&
+         test_and_clear_bit(31, (volatile unsigned long*)next->buffer)) {
 
     dptr = (__u32*)next->buffer;
+    trace_tpr_buf_start(dev, next, 0);
 
-    while( ((dptr[0]>>16)&0xf) != END_TAG ) {
-
-      dev->dmaCount++;
-      tsc = __rdtsc();
+    if (dev->flight && !dev->flightFrozen)
+      tpr_flight_record(dev, next, __rdtsc());
 
-      //  Check if a drop preceded us
-      if ( dptr[0] & (0x808<<20)) {
-        //  How to propagate this?
-        //  Write a drop message to all channels?
-        tprq->fifofull = 1;  // ??
-      }
+    wmask = wmask | tpr_demux_buffer(&dev->dmx, dptr, next, &nmsg);
+    trace_tpr_buf_end(dev, next, nmsg);
 
-      //  Check the message type
-      mtyp = (dptr[0]>>16)&0xf;
-      switch (mtyp) {
-      case BSACNTL_TAG:
-#ifdef TPRDEBUG2
-          printk(KERN_WARNING "%s: BSA_CTRL %lld\n", MOD_NAME, tprq->bsawp);
-#endif
-          dev->dmaBsaCtrl++;
-          wmask = wmask | (1 << (MOD_SHARED+1));
-          pEntry = &tprq->bsaq[tprq->bsawp & (MAX_TPR_BSAQ-1)];
-          memcpy(pEntry, dptr, BSACNTL_MSGSZ);
-          pEntry->fifo_tsc = tsc;
-          tprq->bsawp++;
-          dptr += BSACNTL_MSGSZ>>2;
-          break;
-      case BSAEVNT_TAG:
-#ifdef TPRDEBUG2
-          printk(KERN_WARNING "%s: BSA_EVNT %lld\n", MOD_NAME, tprq->bsawp);
-#endif
-          dev->dmaBsaChan++;
-          wmask = wmask | (1 << (MOD_SHARED+1));
-          pEntry = &tprq->bsaq[tprq->bsawp & (MAX_TPR_BSAQ-1)];
-          memcpy(pEntry, dptr, BSAEVNT_MSGSZ);
-          pEntry->fifo_tsc = tsc;
-          tprq->bsawp++;
-          dptr += BSAEVNT_MSGSZ>>2;
-          break;
-      case EVENT_TAG:
-#ifdef TPRDEBUG2
-          printk(KERN_WARNING "%s: EVENT\n", MOD_NAME);
-#endif
-          dev->dmaEvent++;
-          mch = (dptr[0]>>0)&((1<<MOD_SHARED)-1);
-          if (((dptr[1]<<2)+8)!=EVENT_MSGSZ) {
-            if ((dev->dmaErrors%1024)<4) {
-              printk(KERN_WARNING  "%s: unexpected event dma size %08x(%08x)...truncating.\n", MOD_NAME, EVENT_MSGSZ,(dptr[1]<<2)+8);
-              printk(KERN_WARNING  "  dptr %p  buffer %p  next %p\n", 
-                     dptr, next->buffer, ((struct RxBuffer*)next->lh.next)->buffer);
-              printk(KERN_WARNING  "  dmaCount %u  dmaEvent %u  dmaErrors %u\n",
-                     dev->dmaCount, dev->dmaEvent, dev->dmaErrors);
-            }
-            dev->dmaErrors++;
-
-            dptr[0] = END_TAG << 16;  // terminate
-            break;
-          }
-          pEntry = &tprq->allq[tprq->gwp & (MAX_TPR_ALLQ-1)];
-          memcpy(pEntry, dptr, EVENT_MSGSZ);
-          pEntry->fifo_tsc = tsc;
-          dptr += EVENT_MSGSZ>>2;
-          wmask = wmask | mch;
-          for( ich=0; mch; ich++) {
-              if (mch & (1<<ich)) {
-                  mch = mch & ~(1<<ich);
-                  tprq->allrp[ich].idx[tprq->allwp[ich] & (MAX_TPR_ALLQ-1)] = tprq->gwp;
-                  tprq->allwp[ich]++;
-              }
-          }
-          tprq->gwp++;
-          break;
-      default:
-          printk(KERN_WARNING  "%s: handle unknown msg %08x:%08x\n", MOD_NAME, dptr[0], dptr[1]);
-          dptr[0] = END_TAG << 16;  // terminate
-          break;
-      }
+    //  Queue the dma buffer back to the hardware
+    //  (zero-copy holds it until the readers are done)
+    if (zero_copy)
+      dev->zcEpoch++;
+    else {
+      trace_tpr_rx_free(dev, next);
+      ((struct TprReg*)dev->bar[0].reg)->rxFree[0] = next->dma;
     }
 
-    //  Queue the dma buffer back to the hardware
-    ((struct TprReg*)dev->bar[0].reg)->rxFree[0] = next->dma;
+    next = tpr_rx_next(dev, next);
+    nbuf++;
 
-    next = (struct RxBuffer*)next->lh.next;
+    tpr_hist_add(&dev->histMsgs, nmsg);
+    now = local_clock();
+    tpr_hist_add(&dev->histBuf, now - t0);
+    t0 = now;
   }
 
   dev->rxPend = next;
 
+  if (zero_copy) {
+    spin_lock(&dev->zcLock);
+    tpr_zc_recycle(dev);
+    spin_unlock(&dev->zcLock);
+  }
+
   //  Wake the apps
-  for( ich=0; ich<MOD_SHARED; ich++) {
-    if ((wmask&(1<<ich)) && dev->shared[ich]) {
+  dev->wakeStamp = local_clock();
+  now      = dev->coalescers ? ktime_get_ns() : 0;
+  deadline = 0;
+  for( ich=0; ich<dev->nchan; ich++) {
+    if ((wmask&(1<<ich)) || dev->coalescers) {
       struct shared_tpr *shared;
-      for (shared = dev->shared[ich]; shared; shared = shared->next) {
-        set_bit(0, (volatile unsigned long*)&shared->pendingirq);
+      __u64 count;
+      if (dev->dmx.allmask) {   // index-free: count the new positions
+        count = (wmask&(1<<ich)) ? tprq->gwp - dev->wakewp[ich] : 0;
+        dev->wakewp[ich] = tprq->gwp;
+      }
+      else {
+        count = tprq->allwp[ich] - dev->wakewp[ich];
+        dev->wakewp[ich] = tprq->allwp[ich];
+      }
+      list_for_each_entry_rcu(shared, &dev->shared[ich], list) {
+        if (shared->filt) {       // wakes on its own stream
+          __u64 fcount = shared->filt->fwp - shared->filtWake;
+          shared->filtWake = shared->filt->fwp;
+          tpr_notify(shared, fcount, now, &deadline);
+          continue;
+        }
+        tpr_notify(shared, count, now, &deadline);
 #ifdef TPRDEBUG2
         printk(KERN_WARNING "%s: set pendingirq for %d == %ld\n", MOD_NAME, ich, shared->pendingirq);
 #endif
-        wake_up(&shared->waitq);
       }
     }
   }
 
-  if (wmask & (1 << (MOD_SHARED+1))) {
+  if ((wmask & TPR_DEMUX_BSA_MASK) || dev->coalescers) {
       struct shared_tpr *shared;
-      for (shared = dev->bsa; shared; shared = shared->next) {
-        set_bit(0, (volatile unsigned long*)&shared->pendingirq);
+      __u64 count = tprq->bsawp - dev->wakewp[MAX_CHANNELS];
+      dev->wakewp[MAX_CHANNELS] = tprq->bsawp;
+      list_for_each_entry_rcu(shared, &dev->bsa, list) {
+        tpr_notify(shared, count, now, &deadline);
 #ifdef TPRDEBUG2
         printk(KERN_WARNING "%s: set pendingirq for %d == %ld\n", MOD_NAME, ich, shared->pendingirq);
 #endif
-        wake_up(&shared->waitq);
       }
   }
 
+  rcu_read_unlock();
+
+  //  Being removed; schedule nothing more (tpr_remove)
+  if (READ_ONCE(dev->dmaStopping)) {
+    dev->dmaPolling = 0;
+    return;
+  }
+
+  //  Come back for held wakeups in case traffic stops
+  if (deadline)
+    mod_timer(&dev->coalesceTimer, jiffies + usecs_to_jiffies(div_u64(deadline - now, 1000)) + 1);
+
+  //  Budget spent and more buffers are done; poll again rather than re-arm
+  if (nbuf == budget && test_bit(31, (volatile unsigned long*)next->buffer)) {
+    dev->dmaPolling = TPR_POLL_BUDGET;
+    tasklet_schedule(&dev->dma_task);
+    return;
+  }
+
+  //  Traffic is flowing; let more buffers collect before the next pass
+  holdoff = READ_ONCE(dev->holdoffUs);
+  if (holdoff && nbuf) {
+    dev->dmaPolling = TPR_POLL_HOLDOFF;
+    hrtimer_start(&dev->holdoffTimer, ns_to_ktime((u64)holdoff * 1000), HRTIMER_MODE_REL);
+    return;
+  }
+  dev->dmaPolling = 0;
+
   //  Enable the interrupt
-  if (dev->minors) {
+  if (dev->dmx.minors) {
     ((struct TprReg*)dev->bar[0].reg)->irqControl = 1;
     dev->irqEnable++;
   }
@@ -573,6 +1329,7 @@ irqreturn_t tpr_intr(int irq, void *dev_id) {
   //  wakeup the tasklet that copies the dma data into the sw queues
   //
   stat = ((struct TprReg*)dev->bar[0].reg)->irqStatus;
+  trace_tpr_irq_entry(dev, dev->rxPend, stat);
   if ( (stat & 1) != 0 ) {
     // Disable interrupts
     dev->irqCount++;
@@ -580,10 +1337,13 @@ irqreturn_t tpr_intr(int irq, void *dev_id) {
     if (((struct TprReg*)dev->bar[0].reg)->irqControl==0)
       dev->irqNoReq++;
     ((struct TprReg*)dev->bar[0].reg)->irqControl = 0;
+    dev->irqStamp = local_clock();
     tasklet_schedule(&dev->dma_task);
     handled=1;
   }
 
+  trace_tpr_irq_exit(dev, dev->rxPend, handled);
+
   if (handled==0) return(IRQ_NONE);
 
   return(IRQ_HANDLED);
@@ -602,12 +1362,632 @@ uint tpr_poll(struct file *filp, poll_table *wait ) {
 
 
 
+// Queue memory is built from physically contiguous blocks of this order (2MB
+// on x86), falling back to smaller blocks when memory is fragmented.  The
+// page array is kept so tpr_mmap can map the whole area at once.
+#define TPR_SHM_ORDER 9
+
+static void* tpr_alloc_shm(ulong size, struct page*** ppages, int node)
+{
+  ulong npages = size >> PAGE_SHIFT, i = 0, j;
+  struct page** pages;
+  struct page*  page;
+  void*         vaddr;
+  int           order = TPR_SHM_ORDER;
+
+  pages = vzalloc(npages * sizeof(struct page*));
+  if (!pages)
+    return NULL;
+
+  while (i < npages) {
+    while ((1UL << order) > npages - i)
+      order--;
+    page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | (order ? __GFP_NOWARN | __GFP_NORETRY : 0), order);
+    if (!page) {
+      if (order--)
+        continue;
+      goto fail;
+    }
+    split_page(page, order);
+    for (j = 0; j < (1UL << order); j++)
+      pages[i++] = page + j;
+  }
+
+  vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+  if (!vaddr)
+    goto fail;
+
+  *ppages = pages;
+  return vaddr;
+
+fail:
+  while (i)
+    __free_page(pages[--i]);
+  vfree(pages);
+  return NULL;
+}
+
+static void tpr_free_shm(void* vaddr, struct page** pages, ulong size)
+{
+  ulong i;
+
+  if (!vaddr)
+    return;
+  vunmap(vaddr);
+  for (i = 0; i < (size >> PAGE_SHIFT); i++)
+    __free_page(pages[i]);
+  vfree(pages);
+}
+
+// Channel and trigger counts from the firmware's resources register.  Older
+// firmware reads 0 there and has RO_CHANNELS/TR_CHANNELS.
+static void tpr_resources(struct tpr_dev* dev, struct TprReg* reg)
+{
+  u32 res = reg->resources;
+
+  dev->nchan = (res >> 0) & 0xff;
+  dev->ntrig = (res >> 8) & 0xff;
+
+  if (dev->nchan == 0 || dev->nchan > ARRAY_SIZE(reg->channel) ||
+      dev->ntrig == 0 || dev->ntrig > ARRAY_SIZE(reg->trigger)) {
+    if (res)
+      printk(KERN_WARNING  MOD_NAME ": resources register %08x out of range.\n", res);
+    dev->nchan = RO_CHANNELS;
+    dev->ntrig = TR_CHANNELS;
+  }
+  else if (dev->nchan > MAX_CHANNELS) {
+    printk(KERN_WARNING  MOD_NAME ": firmware has %u channels, only %u have dma.\n",
+           dev->nchan, MAX_CHANNELS);
+    dev->nchan = MAX_CHANNELS;
+  }
+
+  dev->dmx.chanMask = (1U << dev->nchan) - 1;
+  printk(KERN_WARNING  MOD_NAME ": %u channels, %u triggers.\n", dev->nchan, dev->ntrig);
+}
+
+// Lay out the mapped queues for the configured depths.  Each array starts
+// on a page boundary; those not used in this mode are left out.
+static void tpr_layout(struct tpr_dev* dev, struct TprQHeader* hdr)
+{
+  ulong off = PAGE_ALIGN(sizeof(struct TprQueues));
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic      = TPR_Q_MAGIC;
+  hdr->version    = TPR_Q_VERSION;
+  hdr->hdrSize    = sizeof(struct TprQueues);
+  hdr->entrySize  = sizeof(struct TprEntry);
+  hdr->zcDescSize = sizeof(struct TprZcDesc);
+  hdr->nchan      = dev->nchan;
+  hdr->ntrig      = dev->ntrig;
+  hdr->allqDepth  = roundup_pow_of_two(max(allq_depth, 16U));
+  hdr->bsaqDepth  = roundup_pow_of_two(max(bsaq_depth, 16U));
+  hdr->chnqDepth  = chan_queues ? roundup_pow_of_two(max(chnq_depth, 16U)) : 0;
+  hdr->rxBuffers  = zero_copy ? dev->rxCount : 0;
+  hdr->rxBufSize  = dev->rxBufSize;
+
+  if (zero_copy) {
+    hdr->zcqOffset    = off; off += PAGE_ALIGN((ulong)hdr->allqDepth * sizeof(struct TprZcDesc));
+    hdr->zcbsaqOffset = off; off += PAGE_ALIGN((ulong)hdr->bsaqDepth * sizeof(struct TprZcDesc));
+  }
+  else {
+    hdr->allqOffset   = off; off += PAGE_ALIGN((ulong)hdr->allqDepth * sizeof(struct TprEntry));
+    hdr->bsaqOffset   = off; off += PAGE_ALIGN((ulong)hdr->bsaqDepth * sizeof(struct TprEntry));
+  }
+  if (index_free) {
+    hdr->allmaskOffset = off; off += PAGE_ALIGN((ulong)hdr->allqDepth * sizeof(u32));
+  }
+  else {
+    hdr->allrpOffset   = off; off += PAGE_ALIGN((ulong)hdr->nchan * hdr->allqDepth * sizeof(long long));
+  }
+  hdr->nbsa        = MOD_BSA;
+  hdr->bsarpOffset = off; off += PAGE_ALIGN((ulong)MOD_BSA * hdr->bsaqDepth * sizeof(long long));
+  hdr->shmSize     = off;
+
+  if (chan_queues) {
+    hdr->chnqOffset = off;
+    hdr->chnqSize   = PAGE_ALIGN(sizeof(struct TprChQueue) + (ulong)hdr->chnqDepth * sizeof(struct TprEntry));
+    off += hdr->nchan * hdr->chnqSize;
+  }
+  if (compact_queue) {
+    hdr->compactEntrySize = sizeof(struct TprCompact);
+    hdr->compactOffset    = off;
+    hdr->compactSize      = PAGE_ALIGN((ulong)hdr->allqDepth * sizeof(struct TprCompact));
+    off += hdr->compactSize;
+  }
+  if (zero_copy) {
+    hdr->rxbufOffset = off;
+    off += PAGE_ALIGN((ulong)dev->rxCount * dev->rxBufSize);
+  }
+  hdr->filtOffset = off;
+  hdr->filtDepth  = roundup_pow_of_two(max(filt_depth, 16U));
+
+  dev->dmx.allqMask    = hdr->allqDepth - 1;
+  dev->dmx.bsaqMask    = hdr->bsaqDepth - 1;
+  dev->chnqMask    = hdr->chnqDepth - 1;
+  dev->shmSize     = hdr->shmSize;
+  dev->chnqSize    = hdr->chnqSize;
+  dev->chnqOffset  = hdr->chnqOffset;
+  dev->compactSize   = hdr->compactSize;
+  dev->compactOffset = hdr->compactOffset;
+  dev->rxbufOffset = hdr->rxbufOffset;
+  dev->filtOffset  = hdr->filtOffset;
+  dev->filtMask    = hdr->filtDepth - 1;
+}
+
+// Publish a new tsc -> CLOCK_MONOTONIC/CLOCK_TAI calibration point.  The rate
+// is taken from the previous point, or from tsc_khz the first time.
+static void tpr_tsc_calibrate(struct work_struct *work)
+{
+  struct tpr_dev*   dev = container_of(to_delayed_work(work), struct tpr_dev, tscWork);
+  struct TprTscCal* cal = &((struct TprQueues*)dev->amem)->tsccal;
+  unsigned long     flags;
+  u64               tsc, mono, tai, mult = 0;
+
+  local_irq_save(flags);
+  tsc  = __rdtsc();
+  mono = ktime_get_ns();
+  tai  = ktime_to_ns(ktime_get_clocktai());
+  local_irq_restore(flags);
+
+  if (dev->calTsc && tsc > dev->calTsc)
+    mult = div64_u64((mono - dev->calMono) << TPR_TSC_SHIFT, tsc - dev->calTsc);
+  else if (tsc_khz)
+    mult = div64_u64(1000000ULL << TPR_TSC_SHIFT, tsc_khz);
+
+  if (mult) {
+    WRITE_ONCE(cal->gen, cal->gen+1);
+    smp_wmb();
+    cal->shift     = TPR_TSC_SHIFT;
+    cal->mult      = mult;
+    cal->tsc       = tsc;
+    cal->mono      = mono;
+    cal->taiOffset = tai - mono;
+    smp_wmb();
+    WRITE_ONCE(cal->gen, cal->gen+1);
+  }
+
+  dev->calTsc  = tsc;
+  dev->calMono = mono;
+
+  if (tsc_cal_ms)
+    schedule_delayed_work(&dev->tscWork, msecs_to_jiffies(tsc_cal_ms));
+}
+
+// Allocate the rx buffers as one coherent pool carved into rx_buf_size
+// pieces.  If that much contiguous memory is not to be had, settle for
+// fewer buffers.  The descriptors only hold 32-bit addresses.
+//
+// Without CMA the pool is at most KMALLOC_MAX_SIZE (the largest buddy
+// allocation, 4MB on x86), so the buffer size is capped for the smallest
+// pool, TPR_MIN_RX_BUFFERS buffers, to fit.
+static int tpr_alloc_rx(struct tpr_dev* dev)
+{
+  uint want  = clamp(rx_buffers, (uint)TPR_MIN_RX_BUFFERS, (uint)NUMBER_OF_RX_BUFFERS);
+  uint count = want;
+  uint size  = roundup_pow_of_two(clamp(rx_buf_size, 512U, (uint)MAX_BUF_SIZE));
+  uint idx;
+
+  if (size > KMALLOC_MAX_SIZE/TPR_MIN_RX_BUFFERS) {
+    size = KMALLOC_MAX_SIZE/TPR_MIN_RX_BUFFERS;
+    printk(KERN_WARNING "%s: Init: rx_buf_size %u capped at %u bytes.\n", MOD_NAME, rx_buf_size, size);
+  }
+
+  if (dma_set_coherent_mask(&dev->pcidev->dev, DMA_BIT_MASK(32))) {
+    printk(KERN_WARNING "%s: Init: no 32-bit coherent dma.\n", MOD_NAME);
+    return -EIO;
+  }
+
+  while (!(dev->rxPool = dma_alloc_coherent(&dev->pcidev->dev, (size_t)count*size, &dev->rxPoolDma,
+                                             GFP_KERNEL|__GFP_NOWARN))) {
+    if (count == TPR_MIN_RX_BUFFERS) {
+      printk(KERN_WARNING "%s: Init: unable to allocate rx buffers of %u bytes.\n", MOD_NAME, size);
+      return -ENOMEM;
+    }
+    count = max(count/2, (uint)TPR_MIN_RX_BUFFERS);
+  }
+
+  if (count < want)
+    printk(KERN_WARNING "%s: Init: allocated %u of %u rx buffers.\n", MOD_NAME, count, want);
+
+  dev->rxBuffer = vzalloc_node(count * sizeof(struct RxBuffer), dev->node);
+  if (!dev->rxBuffer) {
+    dma_free_coherent(&dev->pcidev->dev, (size_t)count*size, dev->rxPool, dev->rxPoolDma);
+    dev->rxPool = NULL;
+    return -ENOMEM;
+  }
+
+  for (idx = 0; idx < count; idx++) {
+    dev->rxBuffer[idx].buffer = dev->rxPool + (size_t)idx*size;
+    dev->rxBuffer[idx].dma    = dev->rxPoolDma + (size_t)idx*size;
+    dev->rxBuffer[idx].idx    = idx;
+    clear_bit(31,(volatile unsigned long*)dev->rxBuffer[idx].buffer);
+  }
+
+  dev->rxCount   = count;
+  dev->rxBufSize = size;
+  dev->rxPend    = dev->rxBuffer;
+  dev->rxHold    = dev->rxBuffer;
+  return SUCCESS;
+}
+
+// Steer the interrupt, and with it the dma tasklet, to cpu (-1 for any).
+// Clearing the hint alone would leave the interrupt where it was, so for
+// any the affinity is first set back to every online cpu.
+static int tpr_set_dma_cpu(struct tpr_dev* dev, int cpu)
+{
+  int rc;
+
+  if (cpu >= 0) {
+    if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+      return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    rc = irq_set_affinity_and_hint(dev->irq, cpumask_of(cpu));
+#else
+    rc = irq_set_affinity_hint(dev->irq, cpumask_of(cpu));
+#endif
+  }
+  else {
+    //  The hint is dropped even if the affinity cannot be restored, as
+    //  free_irq() requires
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    rc = irq_set_affinity_and_hint(dev->irq, cpu_online_mask);
+    irq_update_affinity_hint(dev->irq, NULL);
+#else
+    rc = irq_set_affinity_hint(dev->irq, cpu_online_mask);
+    irq_set_affinity_hint(dev->irq, NULL);
+#endif
+  }
+
+  if (!rc)
+    dev->dmaCpu = cpu;
+  return rc;
+}
+
+//  sysfs attributes of the pci device
+//    dma_cpu: cpu taking the interrupt and the dma tasklet, -1 for any.  The
+//    interrupt line is shared (IRQF_SHARED): whatever else is on it moves too.
+static ssize_t dma_cpu_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  return scnprintf(buf, PAGE_SIZE, "%d\n", dev->dmaCpu);
+}
+
+static ssize_t dma_cpu_store(struct device *d, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  int cpu, rc;
+
+  if (kstrtoint(buf, 0, &cpu))
+    return -EINVAL;
+  rc = tpr_set_dma_cpu(dev, cpu < 0 ? -1 : cpu);
+  return rc ? rc : count;
+}
+
+static DEVICE_ATTR_RW(dma_cpu);
+
+//  Interrupt holdoff of this card [us], 0 re-arms after every pass
+static ssize_t irq_holdoff_us_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(dev->holdoffUs));
+}
+
+static ssize_t irq_holdoff_us_store(struct device *d, struct device_attribute *attr,
+                                    const char *buf, size_t count)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  uint us;
+
+  if (kstrtouint(buf, 0, &us) || us > USEC_PER_SEC)
+    return -EINVAL;
+  WRITE_ONCE(dev->holdoffUs, us);
+  return count;
+}
+
+//  Firmware fifo level that pauses dma (TprCsr dmaFullThr)
+static ssize_t dma_full_thr_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  return scnprintf(buf, PAGE_SIZE, "%#x\n", ((struct TprReg*)dev->bar[0].reg)->dmaFullThr & 0x3ff);
+}
+
+static ssize_t dma_full_thr_store(struct device *d, struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  uint thr;
+
+  if (kstrtouint(buf, 0, &thr) || thr > 0x3ff)
+    return -EINVAL;
+  ((struct TprReg*)dev->bar[0].reg)->dmaFullThr = thr;
+  return count;
+}
+
+static DEVICE_ATTR_RW(irq_holdoff_us);
+static DEVICE_ATTR_RW(dma_full_thr);
+
+static struct attribute *tpr_attrs[] = {
+  &dev_attr_dma_cpu.attr,
+  &dev_attr_irq_holdoff_us.attr,
+  &dev_attr_dma_full_thr.attr,
+  NULL,
+};
+
+static const struct attribute_group tpr_attr_group = {
+  .attrs = tpr_attrs,
+};
+
+//  Counters under stats/, one 64-bit value per file.  The tasklet and the
+//  interrupt handler are the only writers and a 64-bit load is atomic here,
+//  so they are read without locking.
+#define TPR_STAT_ATTR(name, field)                                      \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf) \
+{                                                                       \
+  struct tpr_dev *dev = dev_get_drvdata(d);                             \
+  return scnprintf(buf, PAGE_SIZE, "%llu\n", READ_ONCE(dev->field));    \
+}                                                                       \
+static DEVICE_ATTR_RO(name)
+
+TPR_STAT_ATTR(irqEnable  , irqEnable);
+TPR_STAT_ATTR(irqDisable , irqDisable);
+TPR_STAT_ATTR(irqCount   , irqCount);
+TPR_STAT_ATTR(irqNoReq   , irqNoReq);
+TPR_STAT_ATTR(dmaCount   , dmx.dmaCount);
+TPR_STAT_ATTR(dmaEvent   , dmx.dmaEvent);
+TPR_STAT_ATTR(dmaErrors  , dmx.dmaErrors);
+TPR_STAT_ATTR(dmaBsaChan , dmx.dmaBsaChan);
+TPR_STAT_ATTR(dmaBsaCtrl , dmx.dmaBsaCtrl);
+TPR_STAT_ATTR(dmaIrqPass , dmaIrqPass);
+TPR_STAT_ATTR(dmaPollPass, dmaPollPass);
+TPR_STAT_ATTR(dmaHoldPass, dmaHoldPass);
+TPR_STAT_ATTR(dmaTimerPass, dmaTimerPass);
+TPR_STAT_ATTR(zcForced   , zcForced);
+
+//  The firmware's 24-bit frame and drop counters (TprCsr), which wrap
+#define TPR_FW_ATTR(name, field)                                        \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf) \
+{                                                                       \
+  struct tpr_dev *dev = dev_get_drvdata(d);                             \
+  return scnprintf(buf, PAGE_SIZE, "%u\n",                              \
+                   ((struct TprReg*)dev->bar[0].reg)->field & 0xffffff); \
+}                                                                       \
+static DEVICE_ATTR_RO(name)
+
+TPR_FW_ATTR(fwDmaCount , dmaCount);
+TPR_FW_ATTR(fwDmaDrops , dmaDrops);
+
+//  Open count of each channel minor, then of the BSA minor
+static ssize_t subscribers_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  struct shared_tpr *sh;
+  uint n[MAX_CHANNELS+1];
+  int i, len = 0;
+
+  spin_lock(&dev->lock);
+  for (i = 0; i < dev->nchan; i++) {
+    n[i] = 0;
+    list_for_each_entry(sh, &dev->shared[i], list)
+      n[i]++;
+  }
+  n[i] = 0;
+  list_for_each_entry(sh, &dev->bsa, list)
+    n[i]++;
+  spin_unlock(&dev->lock);
+
+  for (i = 0; i <= dev->nchan; i++)
+    len += scnprintf(buf+len, PAGE_SIZE-len, "%u%c", n[i], i < dev->nchan ? ' ' : '\n');
+  return len;
+}
+
+//  Opens still available (of OPEN_SHARES)
+static ssize_t free_shares_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+  struct tpr_dev *dev = dev_get_drvdata(d);
+  struct shared_tpr *sh;
+  uint n = 0;
+
+  spin_lock(&dev->lock);
+  list_for_each_entry(sh, &dev->freelist, list)
+    n++;
+  spin_unlock(&dev->lock);
+
+  return scnprintf(buf, PAGE_SIZE, "%u\n", n);
+}
+
+static DEVICE_ATTR_RO(subscribers);
+static DEVICE_ATTR_RO(free_shares);
+
+static struct attribute *tpr_stat_attrs[] = {
+  &dev_attr_irqEnable.attr,
+  &dev_attr_irqDisable.attr,
+  &dev_attr_irqCount.attr,
+  &dev_attr_irqNoReq.attr,
+  &dev_attr_dmaCount.attr,
+  &dev_attr_dmaEvent.attr,
+  &dev_attr_dmaErrors.attr,
+  &dev_attr_dmaBsaChan.attr,
+  &dev_attr_dmaBsaCtrl.attr,
+  &dev_attr_dmaIrqPass.attr,
+  &dev_attr_dmaPollPass.attr,
+  &dev_attr_dmaHoldPass.attr,
+  &dev_attr_dmaTimerPass.attr,
+  &dev_attr_zcForced.attr,
+  &dev_attr_fwDmaCount.attr,
+  &dev_attr_fwDmaDrops.attr,
+  &dev_attr_subscribers.attr,
+  &dev_attr_free_shares.attr,
+  NULL,
+};
+
+static const struct attribute_group tpr_stat_group = {
+  .name  = "stats",
+  .attrs = tpr_stat_attrs,
+};
+
+static const struct attribute_group *tpr_attr_groups[] = {
+  &tpr_attr_group,
+  &tpr_stat_group,
+  NULL,
+};
+
+//  debugfs: latency histograms.  Writing anything resets them.
+static int tpr_latency_show(struct seq_file *s, void *unused)
+{
+  struct tpr_dev *dev = s->private;
+  int i, last = 0;
+
+  seq_printf(s, "irqCount %llu  irqNoReq %llu  dmaCount %llu  dmaEvent %llu  dmaErrors %llu  dmaIrqPass %llu  dmaPollPass %llu  dmaHoldPass %llu  dmaTimerPass %llu\n",
+             dev->irqCount, dev->irqNoReq, dev->dmx.dmaCount, dev->dmx.dmaEvent, dev->dmx.dmaErrors,
+             dev->dmaIrqPass, dev->dmaPollPass, dev->dmaHoldPass, dev->dmaTimerPass);
+
+  for (i = 0; i < TPR_HIST_BINS; i++)
+    if (dev->histIrq.bin[i] || dev->histBuf.bin[i] || dev->histMsgs.bin[i] || dev->histWake.bin[i])
+      last = i;
+
+  seq_printf(s, "%12s %14s %14s %14s %14s\n", "< 2^n", "irq->tasklet", "buffer[ns]", "msgs/buffer", "->wakeup");
+  for (i = 0; i <= last; i++)
+    seq_printf(s, "%12llu %14llu %14llu %14llu %14llu\n", i ? 1ULL << i : 1ULL,
+               dev->histIrq.bin[i], dev->histBuf.bin[i], dev->histMsgs.bin[i], dev->histWake.bin[i]);
+  return 0;
+}
+
+static int tpr_latency_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, tpr_latency_show, inode->i_private);
+}
+
+static ssize_t tpr_latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+  struct tpr_dev *dev = ((struct seq_file*)file->private_data)->private;
+
+  tasklet_disable(&dev->dma_task);
+  memset(&dev->histIrq , 0, sizeof(dev->histIrq));
+  memset(&dev->histBuf , 0, sizeof(dev->histBuf));
+  memset(&dev->histMsgs, 0, sizeof(dev->histMsgs));
+  memset(&dev->histWake, 0, sizeof(dev->histWake));
+  tasklet_enable(&dev->dma_task);
+  return count;
+}
+
+static const struct file_operations tpr_latency_fops = {
+  .owner   = THIS_MODULE,
+  .open    = tpr_latency_open,
+  .read    = seq_read,
+  .write   = tpr_latency_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+//  debugfs: flight recorder, oldest buffer first.  Write 0 to re-arm it,
+//  anything else to freeze it.
+static const char* tpr_flight_why[] = { "recording", "bad event size", "unknown tag", "user" };
+
+static void* tpr_flight_start(struct seq_file *s, loff_t *pos)
+{
+  struct tpr_dev *dev = s->private;
+  u64 n = min_t(u64, READ_ONCE(dev->flightSeq), dev->flightCount);
+
+  if (*pos > n)
+    return NULL;
+  return (void*)(uintptr_t)(*pos + 1);
+}
+
+static void* tpr_flight_next(struct seq_file *s, void *v, loff_t *pos)
+{
+  ++*pos;
+  return tpr_flight_start(s, pos);
+}
+
+static void tpr_flight_stop(struct seq_file *s, void *v)
+{
+}
+
+static int tpr_flight_show(struct seq_file *s, void *v)
+{
+  struct tpr_dev *dev = s->private;
+  u64 n = (uintptr_t)v - 1;
+  u64 seq, first;
+  struct tpr_flight* f;
+  __u32* w;
+  uint i;
+
+  //  Records are numbered from the oldest still held
+  seq   = READ_ONCE(dev->flightSeq);
+  first = seq > dev->flightCount ? seq - dev->flightCount : 0;
+
+  if (n == 0) {
+    seq_printf(s, "%s", tpr_flight_why[dev->flightFrozen]);
+    if (dev->flightFrozen && dev->flightFrozen != TPR_FLIGHT_USER)
+      seq_printf(s, " in buffer %llu: word %08x at offset %u", seq-1, dev->flightWord, dev->flightOffset);
+    seq_printf(s, "\nbuffers %llu-%llu of %u bytes each\n", first, seq-1, dev->flightStride - (uint)sizeof(*f));
+    return 0;
+  }
+
+  f = tpr_flight_at(dev, first + n - 1);
+  if (smp_load_acquire(&f->seq) != first + n - 1) {
+    seq_printf(s, "buffer %llu: overwritten\n", first + n - 1);
+    return 0;
+  }
+  seq_printf(s, "buffer %llu  idx %u  tsc %llu  irqCount %llu  dmaCount %llu  dmaEvent %llu  dmaErrors %llu  dmaBsaChan %llu  dmaBsaCtrl %llu\n",
+             f->seq, f->idx, f->tsc, f->irqCount, f->dmaCount, f->dmaEvent, f->dmaErrors, f->dmaBsaChan, f->dmaBsaCtrl);
+  w = (__u32*)f->data;
+  for (i = 0; i < f->bytes/4; i++)
+    seq_printf(s, "%08x%c", w[i], (i%8)==7 ? '\n' : ' ');
+  if (i%8)
+    seq_putc(s, '\n');
+  smp_rmb();
+  if (READ_ONCE(f->seq) != first + n - 1)
+    seq_printf(s, "buffer %llu: overwritten while dumped\n", first + n - 1);
+  return 0;
+}
+
+static const struct seq_operations tpr_flight_seqops = {
+  .start = tpr_flight_start,
+  .next  = tpr_flight_next,
+  .stop  = tpr_flight_stop,
+  .show  = tpr_flight_show,
+};
+
+static int tpr_flight_open(struct inode *inode, struct file *file)
+{
+  int rc = seq_open(file, &tpr_flight_seqops);
+  if (!rc)
+    ((struct seq_file*)file->private_data)->private = inode->i_private;
+  return rc;
+}
+
+static ssize_t tpr_flight_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+  struct tpr_dev *dev = ((struct seq_file*)file->private_data)->private;
+  char c;
+
+  if (!count || get_user(c, buf))
+    return -EFAULT;
+
+  tasklet_disable(&dev->dma_task);
+  dev->flightFrozen = (c == '0') ? 0 : TPR_FLIGHT_USER;
+  tasklet_enable(&dev->dma_task);
+  return count;
+}
+
+static const struct file_operations tpr_flight_fops = {
+  .owner   = THIS_MODULE,
+  .open    = tpr_flight_open,
+  .read    = seq_read,
+  .write   = tpr_flight_write,
+  .llseek  = seq_lseek,
+  .release = seq_release,
+};
+
 // Probe device
 int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
    int i, idx, res;
    dev_t chrdev = 0;
    struct tpr_dev* dev;
    struct TprReg*  tprreg;
+   struct TprQHeader hdr;
    struct pci_device_id *id = (struct pci_device_id *) dev_id;
 
    printk(KERN_WARNING  MOD_NAME GITV);
@@ -630,80 +2010,167 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
    }
    dev = &gDevices[id->driver_data];
 
-   dev->qmem = (void *)vmalloc(sizeof(struct TprQueues) + PAGE_SIZE); // , GFP_KERNEL);
-   if (!dev->qmem) {
-     printk(KERN_WARNING  MOD_NAME ": could not allocate %lu.\n", sizeof(struct TprQueues) + PAGE_SIZE);
+   // Allocate device numbers for character device.
+   res = alloc_chrdev_region(&chrdev, 0, MOD_MINORS, MOD_NAME);
+   if (res < 0) {
+     printk(KERN_WARNING  "%s: Probe: Cannot register char device\n", MOD_NAME);
+     return res;
+   }
+   dev->major = MAJOR(chrdev);
+
+   // Enable devices.  The registers come first: the queues are sized by
+   // what the firmware has.
+   if (pci_enable_device(pcidev)) {
+     printk(KERN_WARNING  "%s: Could not enable device \n", MOD_NAME);
+     return (ERROR);
+   }
+
+   if (allocBar(&dev->bar[0], dev->major, pcidev, 0) == ERROR)
+     return (ERROR);
+
+   tprreg = (struct TprReg* )(dev->bar[0].reg);
+   tpr_resources(dev, tprreg);
+
+   //  Keep the queues and buffers on the card's socket
+   dev->pcidev = pcidev;
+   dev->node = dev_to_node(&pcidev->dev);
+
+   //  (dma_alloc_coherent already allocates on the device's node)
+   res = tpr_alloc_rx(dev);
+   if (res)
+     return res;
+
+   dev->flight       = NULL;
+   dev->flightSeq    = 0;
+   dev->flightFrozen = 0;
+   if (flight_buffers) {
+     dev->flightCount  = flight_buffers;
+     dev->flightStride = sizeof(struct tpr_flight) + ALIGN(clamp(flight_bytes, 4U, dev->rxBufSize), 8);
+     dev->flight = vzalloc_node((size_t)dev->flightCount * dev->flightStride, dev->node);
+     if (!dev->flight)
+       printk(KERN_WARNING  MOD_NAME ": could not allocate the flight recorder.\n");
+   }
+
+   tpr_layout(dev, &hdr);
+   hdr.node = dev->node;
+
+   dev->amem = tpr_alloc_shm(dev->shmSize, &dev->qpages, dev->node);
+   if (!dev->amem) {
+     printk(KERN_WARNING  MOD_NAME ": could not allocate %lu.\n", dev->shmSize);
      return -ENOMEM;
    }
 
-   printk(KERN_WARNING  MOD_NAME ": Allocated %lu at %p.\n", sizeof(struct TprQueues) + PAGE_SIZE, dev->qmem);
-   memset(dev->qmem, 0, sizeof(struct TprQueues) + PAGE_SIZE);
-   dev->amem = (void *)((long)(dev->qmem + PAGE_SIZE - 1) & PAGE_MASK);
+   printk(KERN_WARNING  MOD_NAME ": Allocated %lu at %p on node %d.\n", dev->shmSize, dev->amem, dev->node);
    ((struct TprQueues*) dev->amem)->fifofull = 0xabadcafe;
 
-   printk(KERN_WARNING  MOD_NAME ": amem = %p.\n", dev->amem);
+   dev->dmx.tprq  = dev->amem;
+   dev->dmx.allq  = hdr.allqOffset   ? dev->amem + hdr.allqOffset   : NULL;
+   dev->dmx.bsaq  = hdr.bsaqOffset   ? dev->amem + hdr.bsaqOffset   : NULL;
+   dev->dmx.allrp = hdr.allrpOffset   ? dev->amem + hdr.allrpOffset   : NULL;
+   dev->dmx.allmask = hdr.allmaskOffset ? dev->amem + hdr.allmaskOffset : NULL;
+   dev->dmx.bsarp = dev->amem + hdr.bsarpOffset;
+   dev->dmx.zc    = zero_copy;
+   dev->zcq       = hdr.zcqOffset    ? dev->amem + hdr.zcqOffset    : NULL;
+   dev->zcbsaq    = hdr.zcbsaqOffset ? dev->amem + hdr.zcbsaqOffset : NULL;
+
+   printk(KERN_WARNING  MOD_NAME ": allq %u, bsaq %u, chnq %u entries.\n",
+          hdr.allqDepth, hdr.bsaqDepth, hdr.chnqDepth);
+
+   dev->cmem = NULL;
+   if (chan_queues) {
+     dev->cmem = tpr_alloc_shm(dev->nchan * dev->chnqSize, &dev->cpages, dev->node);
+     if (!dev->cmem) {
+       printk(KERN_WARNING  MOD_NAME ": could not allocate %lu for channel queues.\n", dev->nchan * dev->chnqSize);
+       tpr_free_shm(dev->amem, dev->qpages, dev->shmSize);
+       return -ENOMEM;
+     }
+     printk(KERN_WARNING  MOD_NAME ": Allocated %lu for channel queues at %p.\n", dev->nchan * dev->chnqSize, dev->cmem);
+   }
 
-   // Allocate device numbers for character device.
-   res = alloc_chrdev_region(&chrdev, 0, MOD_MINORS, MOD_NAME);
-   if (res < 0) {
-     printk(KERN_WARNING  "%s: Probe: Cannot register char device\n", MOD_NAME);
-     return res;
+   dev->dmx.compact = NULL;
+   if (compact_queue) {
+     dev->dmx.compact = tpr_alloc_shm(dev->compactSize, &dev->kpages, dev->node);
+     if (!dev->dmx.compact) {
+       printk(KERN_WARNING  MOD_NAME ": could not allocate %lu for the compact ring.\n", dev->compactSize);
+       tpr_free_shm(dev->cmem, dev->cpages, dev->nchan * dev->chnqSize);
+       tpr_free_shm(dev->amem, dev->qpages, dev->shmSize);
+       return -ENOMEM;
+     }
+     printk(KERN_WARNING  MOD_NAME ": Allocated %lu for the compact ring at %p.\n", dev->compactSize, dev->dmx.compact);
    }
 
+   //  Describe the layout for userspace
+   ((struct TprQueues*) dev->amem)->hdr = hdr;
+
+   dev->calTsc = 0;
+   INIT_DELAYED_WORK(&dev->tscWork, tpr_tsc_calibrate);
+   tpr_tsc_calibrate(&dev->tscWork.work);
+
    // Initialize device structure
-   dev->major           = MAJOR(chrdev);
    cdev_init(&dev->cdev, &tpr_intf);
    dev->cdev.owner      = THIS_MODULE;
-   dev->bar[0].baseHdwr = 0;
-   dev->bar[0].baseLen  = 0;
-   dev->bar[0].reg      = 0;
    dev->dma_task.func   = tpr_handle_dma;
    dev->dma_task.data   = i;
-   dev->minors          = 0;
+   dev->dmx.minors      = 0;
+   dev->dmx.bsaOpen     = 0;
    dev->irqEnable       = 0;
    dev->irqDisable      = 0;
    dev->irqCount        = 0;
    dev->irqNoReq        = 0;
-   dev->dmaCount        = 0;
-   dev->dmaEvent        = 0;
-   dev->dmaErrors       = 0;
-   dev->dmaBsaChan      = 0;
-   dev->dmaBsaCtrl      = 0;
+   dev->dmx.dmaCount    = 0;
+   dev->dmx.dmaEvent    = 0;
+   dev->dmx.dmaErrors   = 0;
+   dev->dmx.dmaBsaChan  = 0;
+   dev->dmx.dmaBsaCtrl  = 0;
+   dev->dmaIrqPass      = 0;
+   dev->dmaPollPass     = 0;
+   dev->dmaHoldPass     = 0;
+   dev->dmaTimerPass    = 0;
+   dev->dmaPolling      = 0;
+   dev->dmaStopping     = 0;
+   dev->zcReaders       = 0;
+   dev->zcForced        = 0;
+   dev->zcEpoch         = 0;
+   dev->zcFree          = 0;
+   spin_lock_init(&dev->zcLock);
+   memset(dev->wakewp, 0, sizeof(dev->wakewp));
+   dev->coalescers      = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+   timer_setup(&dev->coalesceTimer, tpr_coalesce_timer, 0);
+#else
+   setup_timer(&dev->coalesceTimer, tpr_coalesce_timer, (unsigned long)dev);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+   hrtimer_setup(&dev->holdoffTimer, tpr_holdoff_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+   hrtimer_init(&dev->holdoffTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   dev->holdoffTimer.function = tpr_holdoff_timer;
+#endif
 
    // Add device
    if ( cdev_add(&dev->cdev, chrdev, MOD_MINORS) )
      printk(KERN_WARNING  "%s: Probe: Error adding device Maj=%i\n", MOD_NAME, dev->major);
 
-   // Enable devices
-   if (pci_enable_device(pcidev)) {
-     printk(KERN_WARNING  "%s: Could not enable device \n", MOD_NAME);
-     return (ERROR);
-   }
-
-   if (allocBar(&dev->bar[0], dev->major, pcidev, 0) == ERROR)
-     return (ERROR);
-
    // Get IRQ from pci_dev structure.
    dev->irq = pcidev->irq;
    printk(KERN_WARNING  "%s: Init: IRQ %d Maj=%i\n", MOD_NAME, dev->irq, dev->major);
 
+   INIT_LIST_HEAD(&dev->freelist);
    for( i = 0; i < OPEN_SHARES; i++) {
-     if (i)
-         dev->all_shares[i].next = &dev->all_shares[i-1];
-     else
-         dev->all_shares[i].next = NULL;
-     dev->all_shares[i].prev = NULL;   // The freelist is singly linked!
+     list_add(&dev->all_shares[i].list, &dev->freelist);
      dev->all_shares[i].parent = NULL;
      dev->all_shares[i].idx = i;
+     dev->all_shares[i].zcReader = 0;
+     dev->all_shares[i].efd = NULL;
      init_waitqueue_head(&dev->all_shares[i].waitq);
      spin_lock_init(&dev->all_shares[i].lock);
+     mutex_init(&dev->all_shares[i].readLock);
    }
-   for( i = 0; i < MOD_SHARED; i++) {
-     dev->shared[i] = NULL;
+   for( i = 0; i < MAX_CHANNELS; i++) {
+     INIT_LIST_HEAD(&dev->shared[i]);
    }
-   dev->bsa = NULL;
+   INIT_LIST_HEAD(&dev->bsa);
    spin_lock_init(&dev->lock);
-   dev->freelist = &dev->all_shares[OPEN_SHARES-1];
 
    dev->master.parent = NULL;
    dev->master.idx    = -1;
@@ -711,8 +2178,6 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
    spin_lock_init     (&dev->master.lock);
 
    // Device initialization
-   tprreg = (struct TprReg* )(dev->bar[0].reg);
-
    printk(KERN_WARNING  "%s: Init: FpgaVersion %08x Maj=%i\n",
           MOD_NAME, tprreg->FpgaVersion, dev->major);
 
@@ -720,39 +2185,17 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
 
    tprreg->irqControl = 0;  // Disable interrupts
 
-   for( i=0; i<TR_CHANNELS; i++) {
+   for( i=0; i<dev->ntrig; i++) {
      tprreg->trigger[i].control=0;  // Disable all channels
    }
 
    // FIFO size for detecting DMA complete
-   tprreg->rxFifoSize = NUMBER_OF_RX_BUFFERS-1;
-   tprreg->rxMaxFrame = BUF_SIZE | (1<<31);
-
-   // Init RX Buffers
-   dev->rxBuffer   = (struct RxBuffer **) vmalloc(NUMBER_OF_RX_BUFFERS * sizeof(struct RxBuffer *));
-
-   for ( idx=0; idx < NUMBER_OF_RX_BUFFERS; idx++ ) {
-     dev->rxBuffer[idx] = (struct RxBuffer *) vmalloc(sizeof(struct RxBuffer ));
-     if ((dev->rxBuffer[idx]->buffer = dma_alloc_coherent(&pcidev->dev, BUF_SIZE, &(dev->rxBuffer[idx]->dma),GFP_DMA32|GFP_KERNEL)) == NULL ) {
-       printk(KERN_WARNING "%s: Init: unable to allocate rx buffer [%d/%d]. Maj=%i\n",
-              MOD_NAME, idx, NUMBER_OF_RX_BUFFERS, dev->major);
-       break;
-     }
-
-     clear_bit(31,(volatile unsigned long*)dev->rxBuffer[idx]->buffer);
-
-     // Add to RX queue
-     if (idx == 0) {
-       dev->rxFree = dev->rxBuffer[idx];
-       INIT_LIST_HEAD(&dev->rxFree->lh);
-     }
-     else
-       list_add_tail( &dev->rxBuffer[idx]->lh,
-                      &dev->rxFree->lh );
-     tprreg->rxFree[0] = dev->rxBuffer[idx]->dma;
-   }
+   tprreg->rxFifoSize = dev->rxCount-1;
+   tprreg->rxMaxFrame = dev->rxBufSize | (1<<31);
 
-   dev->rxPend = dev->rxFree;
+   // Give the RX Buffers to the hardware
+   for ( idx=0; idx < dev->rxCount; idx++ )
+     tprreg->rxFree[0] = dev->rxBuffer[idx].dma;
 
    // Request IRQ from OS.
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
@@ -764,13 +2207,31 @@ int tpr_probe(struct pci_dev *pcidev, const struct pci_device_id *dev_id) {
      return (ERROR);
    }
 
+   // Take the interrupt, and so the dma tasklet, on the card's node
+   dev->dmaCpu = -1;
+   dev->holdoffUs = irq_holdoff_us;
+   if (dev->node != NUMA_NO_NODE) {
+     i = cpumask_any_and(cpumask_of_node(dev->node), cpu_online_mask);
+     if (i < nr_cpu_ids)
+       tpr_set_dma_cpu(dev, i);
+   }
+
+   pci_set_drvdata(pcidev, dev);
+   dev->irqStamp = 0;
+   dev->debugfs = debugfs_create_dir(pci_name(pcidev), tpr_debugfs);
+   debugfs_create_file("latency", 0644, dev->debugfs, dev, &tpr_latency_fops);
+   if (dev->flight)
+     debugfs_create_file("flight", 0644, dev->debugfs, dev, &tpr_flight_fops);
+   if (sysfs_create_groups(&pcidev->dev.kobj, tpr_attr_groups))
+     printk(KERN_WARNING  "%s: Probe: could not create sysfs attributes. Maj=%i\n", MOD_NAME, dev->major);
+
    printk(KERN_ALERT "%s: Init: Driver is loaded. Maj=%i. Bus=%x\n", MOD_NAME,dev->major,pcidev->bus->number);
    return SUCCESS;
 }
 
 
 void tpr_remove(struct pci_dev *pcidev) {
-   int  i, idx;
+   int  i;
    struct tpr_dev *dev = NULL;
    struct TprReg*  tprreg;
 
@@ -789,6 +2250,13 @@ void tpr_remove(struct pci_dev *pcidev) {
    else {
      unsigned long flags;
 
+     sysfs_remove_groups(&pcidev->dev.kobj, tpr_attr_groups);
+     debugfs_remove_recursive(dev->debugfs);
+     tpr_set_dma_cpu(dev, -1);
+
+     // From here the tasklet neither re-arms the timers nor reschedules itself
+     WRITE_ONCE(dev->dmaStopping, 1);
+
      spin_lock_irqsave(&dev->lock, flags);
      // At this point, there might be an IRQ/tasklet running.  We're blocking
      // another IRQ from coming though.
@@ -810,26 +2278,33 @@ void tpr_remove(struct pci_dev *pcidev) {
      // We should be finished now.
      spin_unlock_irqrestore(&dev->lock, flags);
 
+     // The last pass before dmaStopping may have armed a timer.  Once both
+     // are stopped, the one pass they may have scheduled arms nothing.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+     timer_delete_sync(&dev->coalesceTimer);
+#else
+     del_timer_sync(&dev->coalesceTimer);
+#endif
+     hrtimer_cancel(&dev->holdoffTimer);
+     tasklet_kill(&dev->dma_task);
+     cancel_delayed_work_sync(&dev->tscWork);
+
      //  Clear the registers
-     for( i=0; i<RO_CHANNELS; i++)
+     for( i=0; i<dev->nchan; i++)
        tprreg->channel[i].control=0;  // Disable event selection, DMA
-     for( i=0; i<TR_CHANNELS; i++)
+     for( i=0; i<dev->ntrig; i++)
        tprreg->trigger[i].control=0;  // Disable TTL
 
      //  Free all rx buffers awaiting read.
      tprreg->rxMaxFrame = 0;
 
      //  Free the rx buffer memory.
-     for ( idx=0; idx < NUMBER_OF_RX_BUFFERS; idx++ ) {
-       if (dev->rxBuffer[idx]->dma != 0) {
-         dma_free_coherent( &pcidev->dev, BUF_SIZE, dev->rxBuffer[idx]->buffer, dev->rxBuffer[idx]->dma);
-         if (dev->rxBuffer[idx]) {
-           vfree(dev->rxBuffer[idx]);
-         }
-       }
-     }
+     dma_free_coherent( &pcidev->dev, (size_t)dev->rxCount*dev->rxBufSize, dev->rxPool, dev->rxPoolDma);
      vfree(dev->rxBuffer);
-     vfree(dev->qmem);
+     vfree(dev->flight);
+     tpr_free_shm(dev->amem, dev->qpages, dev->shmSize);
+     tpr_free_shm(dev->cmem, dev->cpages, dev->nchan * dev->chnqSize);
+     tpr_free_shm(dev->dmx.compact, dev->kpages, dev->compactSize);
 
      // Unmap
      iounmap(dev->bar[0].reg);
@@ -857,6 +2332,7 @@ int tpr_mmap(struct file *filp, struct vm_area_struct *vma)
    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
    unsigned long vsize  = vma->vm_end - vma->vm_start;
    unsigned long physical;
+   struct page** pages = NULL;   /* Queue pages to map now */
 
    int result;
 
@@ -871,13 +2347,83 @@ int tpr_mmap(struct file *filp, struct vm_area_struct *vma)
                                  vsize, vma->vm_page_prot);
      if (result) return -EAGAIN;
    }
+   else if (shared->parent->cmem && offset == shared->parent->chnqOffset) {
+     if (shared->minor < 0) {
+       printk(KERN_WARNING "%s: Mmap: no channel queue for this device. Maj=%i\n", MOD_NAME,
+              shared->parent->major);
+       return -EINVAL;
+     }
+     if (vsize > shared->parent->chnqSize) {
+       printk(KERN_WARNING "%s: Mmap: mmap vsize %08x, chnqSize %08x. Maj=%i\n", MOD_NAME,
+              (unsigned int) vsize, (unsigned int)shared->parent->chnqSize, shared->parent->major);
+       return -EINVAL;
+     }
+     /* Redirect to this minor's queue */
+     vma->vm_pgoff = (shared->parent->chnqOffset + shared->minor*shared->parent->chnqSize) >> PAGE_SHIFT;
+     pages = shared->parent->cpages + ((shared->minor*shared->parent->chnqSize) >> PAGE_SHIFT);
+   }
+   else if (shared->parent->dmx.compact && offset == shared->parent->compactOffset) {
+     if (vsize > shared->parent->compactSize) {
+       printk(KERN_WARNING "%s: Mmap: mmap vsize %08x, compactSize %08x. Maj=%i\n", MOD_NAME,
+              (unsigned int) vsize, (unsigned int)shared->parent->compactSize, shared->parent->major);
+       return -EINVAL;
+     }
+     pages = shared->parent->kpages;
+   }
+   else if (offset == shared->parent->filtOffset) {
+     if (!shared->filt) {
+       printk(KERN_WARNING "%s: Mmap: no filter set on this open (TPR_IOC_FILTER). Maj=%i\n", MOD_NAME,
+              shared->parent->major);
+       return -EINVAL;
+     }
+     /* vmalloc_user memory, mapped in full now */
+     vma->vm_pgoff = 0;
+     result = remap_vmalloc_range(vma, shared->filt, 0);
+     if (result) return result;
+   }
+   else if (zero_copy && offset == shared->parent->rxbufOffset) {
+     struct tpr_dev *dev = shared->parent;
+     size_t poolSize = (size_t)dev->rxCount*dev->rxBufSize;
+     if (vsize > PAGE_ALIGN(poolSize)) {
+       printk(KERN_WARNING "%s: Mmap: mmap vsize %08x, rx buffers %08x. Maj=%i\n", MOD_NAME,
+              (unsigned int) vsize, (unsigned int)poolSize, dev->major);
+       return -EINVAL;
+     }
+     if (vma->vm_flags & VM_WRITE)
+       return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+     vm_flags_clear(vma, VM_MAYWRITE);
+#else
+     vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+     /* Map the pool from its start */
+     vma->vm_pgoff = 0;
+     result = dma_mmap_coherent(&dev->pcidev->dev, vma, dev->rxPool, dev->rxPoolDma, poolSize);
+     if (result) return result;
+     /* Register as a reader; buffers are held until released by ioctl */
+     spin_lock_bh(&dev->zcLock);
+     if (!shared->zcReader) {
+       shared->zcReader = 1;
+       shared->zcEpoch  = dev->zcEpoch;
+       dev->zcReaders++;
+     }
+     spin_unlock_bh(&dev->zcLock);
+   }
    else {
-     if (vsize > TPR_SH_MEM_WINDOW) {
-       printk(KERN_WARNING "%s: Mmap: mmap vsize %08x, TPR_SH_MEM_WINDOW %08x. Maj=%i\n", MOD_NAME,
-              (unsigned int) vsize, (unsigned int)TPR_SH_MEM_WINDOW, shared->parent->major);
+     if (offset + vsize > shared->parent->shmSize) {
+       printk(KERN_WARNING "%s: Mmap: mmap offset %08x vsize %08x, shmSize %08x. Maj=%i\n", MOD_NAME,
+              (unsigned int) offset, (unsigned int) vsize, (unsigned int)shared->parent->shmSize, shared->parent->major);
        return -EINVAL;
      }
-     /* Handled by tpr_vmfault */
+     pages = shared->parent->qpages + vma->vm_pgoff;
+   }
+
+   /* Populate the queue mappings up front rather than fault them in */
+   if (pages) {
+     for (physical = 0; physical < vsize; physical += PAGE_SIZE) {
+       result = vm_insert_page(vma, vma->vm_start + physical, *pages++);
+       if (result) return result;
+     }
    }
 
    vma->vm_ops = &tpr_vmops;
@@ -913,15 +2459,24 @@ int tpr_vmfault(struct vm_area_struct* vma,
 #endif
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
-  struct tpr_dev* dev = (struct tpr_dev *) vmf->vma->vm_private_data;
-#else
-  struct tpr_dev* dev = vma->vm_private_data;
+  struct vm_area_struct* vma = vmf->vma;
 #endif
-  void* pageptr;
-
-  pageptr = dev->amem + (vmf->pgoff << PAGE_SHIFT);
-
-  vmf->page = vmalloc_to_page(pageptr);
+  struct tpr_dev* dev = vma->vm_private_data;
+  unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+
+  // The rx buffer pool and filtered indexes are mapped in full at mmap
+  if (vma->vm_flags & (VM_PFNMAP | VM_DONTEXPAND))
+    return VM_FAULT_SIGBUS;
+
+  if (offset < dev->shmSize)
+    vmf->page = dev->qpages[offset >> PAGE_SHIFT];
+  else if (dev->cmem && offset < dev->chnqOffset + dev->nchan*dev->chnqSize)
+    vmf->page = dev->cpages[(offset - dev->chnqOffset) >> PAGE_SHIFT];
+  else if (dev->dmx.compact && offset >= dev->compactOffset &&
+           offset < dev->compactOffset + dev->compactSize)
+    vmf->page = dev->kpages[(offset - dev->compactOffset) >> PAGE_SHIFT];
+  else
+    return VM_FAULT_SIGBUS;
 
   get_page(vmf->page);
 
@@ -964,6 +2519,13 @@ int tpr_init(void) {
 
    printk(KERN_WARNING "%s: Init: tpr init.\n", MOD_NAME);
 
+   if (index_free && chan_queues) {
+     printk(KERN_WARNING "%s: Init: chan_queues is fed by the channel indexing; off with index_free.\n", MOD_NAME);
+     chan_queues = 0;
+   }
+
+   tpr_debugfs = debugfs_create_dir(MOD_NAME, NULL);
+
    // Register driver
    return(pci_register_driver(&tprDriver));
 }
@@ -973,6 +2535,7 @@ int tpr_init(void) {
 void tpr_exit(void) {
    printk(KERN_WARNING "%s: Exit: tpr exit.\n", MOD_NAME);
    pci_unregister_driver(&tprDriver);
+   debugfs_remove_recursive(tpr_debugfs);
 }
 
 
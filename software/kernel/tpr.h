@@ -18,6 +18,13 @@
 #include<linux/spinlock.h>
 #include<linux/version.h>
 #include <linux/types.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include "tpr_queues.h"
+#include "tpr_demux.h"
 
 #define MOD_NAME "tpr"
 
@@ -25,15 +32,58 @@
 #define SUCCESS 0
 #define ERROR   -1
 
-// TPR message tags
-#define EVENT_TAG    0
-#define BSACNTL_TAG  1
-#define BSAEVNT_TAG  2
-#define END_TAG     15
+// ioctls
+#define TPR_IOC_MAGIC      0xB7
+#define TPR_IOC_ZC_RELEASE _IOW(TPR_IOC_MAGIC, 1, __u64)  /* Done with rx buffers below epoch */
+#define TPR_IOC_EVENTFD    _IOW(TPR_IOC_MAGIC, 2, int)    /* Signal this eventfd (-1 to clear) */
+#define TPR_IOC_COALESCE   _IOW(TPR_IOC_MAGIC, 3, struct tpr_coalesce)
+#define TPR_IOC_FILTER     _IOW(TPR_IOC_MAGIC, 4, struct tpr_filter)
+#define TPR_IOC_READMODE   _IOW(TPR_IOC_MAGIC, 5, int)    /* TPR_READ_PENDING or TPR_READ_ENTRIES */
 
-#define EVENT_MSGSZ    92
-#define BSACNTL_MSGSZ  44
-#define BSAEVNT_MSGSZ  44
+/*
+ * Wakeup coalescing for one open.  The client is woken once minEntries new
+ * entries are pending, or once the oldest pending entry has waited
+ * maxDelayUs.  Zero disables either condition; both zero wakes on every pass.
+ */
+struct tpr_coalesce {
+  __u32 minEntries;
+  __u32 maxDelayUs;
+};
+
+/*
+ * Event filter for one open of a channel.  Entries of the channel that pass
+ * are indexed into a private TprFiltQueue, mapped at hdr.filtOffset, and
+ * only those count towards this open's wakeups.  A zero field passes
+ * everything; decimation applies to what passes the other tests.
+ */
+#define TPR_FILTER_NOBEAM  (1<<16)  /* destMask bit for frames without beam */
+
+struct tpr_filter {
+  __u32 decimate;      /* Pass every Nth entry */
+  __u32 modulo;        /* Pass pulse ids with pulseId % modulo == phase */
+  __u32 phase;
+  __u32 destMask;      /* Beam destinations to pass (bit n: destination n) */
+};
+
+/*
+ * What read() returns for one open.  With TPR_READ_ENTRIES each read copies
+ * as many whole TprEntry records as fit, from a cursor private to the open
+ * into its stream (the channel's allrp, its filtered index, or bsaq), and
+ * ends with a tpr_read_trailer.  The cursor starts at the write pointer when
+ * the mode is set.  Not available with zero_copy.
+ */
+#define TPR_READ_PENDING  0    /* The pending irq mask (default) */
+#define TPR_READ_ENTRIES  1
+
+struct tpr_read_trailer {
+  __u32 entries;       /* TprEntry records ahead of this trailer */
+  __u32 reserved;
+  __s64 rp;            /* The cursor after this read */
+  __s64 wp;            /* The stream's write pointer when last checked */
+  __u64 lost;          /* Entries overwritten before this open read them, since the mode was set.
+                          Index-free, allq positions of any channel (their tags are gone too) */
+  __u64 drops;         /* Firmware drops seen by the stream (TprChStats.drops) */
+};
 
 /*
  * The data for a particular application on a shared device.
@@ -44,19 +94,61 @@ struct shared_tpr {
   int             minor;       /* The index of list containing this structure in parent->shared. -1 for bsa. */
   u32             irqmask;     /* The IRQs this client wants to see. */
   unsigned long   pendingirq;  /* IRQs still to be delivered. */
+  int             zcReader;    /* Has the rx buffers mapped (zero-copy) */
+  u64             zcEpoch;     /* Rx buffers below this epoch are released by this client */
+  struct eventfd_ctx *efd;     /* Credited with the new entry count at each wakeup */
+  u32             wakeMin;     /* Coalescing: entries needed for a wakeup */
+  u64             wakeDelay;   /* Coalescing: longest an entry is held back [ns] */
+  u64             pending;     /* Entries held back since the last wakeup */
+  u64             pendingSince;
+  struct tpr_filter filter;
+  u32             decimCount;
+  struct TprFiltQueue *filt;   /* Filtered index into allq.  NULL unless filtering */
+  long long       filtWake;    /* filt->fwp at the last wakeup */
+  int             readMode;    /* TPR_READ_* */
+  long long       readRp;      /* TPR_READ_ENTRIES cursor into the stream */
+  u64             readLost;
+  struct mutex    readLock;    /* Serializes readers of the cursor */
   wait_queue_head_t waitq;
   spinlock_t      lock;
-  struct shared_tpr *next;
-  struct shared_tpr *prev;
+  struct list_head list;       /* On a subscriber list (RCU) or on the freelist */
+};
+
+/*
+ * Log2 histogram: bin n counts values in [2^(n-1), 2^n), bin 0 counts zeros.
+ */
+#define TPR_HIST_BINS 32
+
+struct tpr_hist {
+  u64 bin[TPR_HIST_BINS];
 };
 
+/*
+ * Flight recorder record: the head of one raw rx buffer as the firmware
+ * wrote it, and the device counters at that moment.
+ */
+struct tpr_flight {
+  s64 seq;              /* rx buffer count when captured, TPR_SEQ_BUSY while written */
+  u64 tsc;
+  u32 idx;              /* rx buffer index */
+  u32 bytes;            /* bytes captured */
+  u64 irqCount;
+  u64 dmaCount;
+  u64 dmaEvent;
+  u64 dmaErrors;
+  u64 dmaBsaChan;
+  u64 dmaBsaCtrl;
+  u8  data[];
+};
+
+#define TPR_FLIGHT_USER     3   /* Freeze reason, after the tpr_demux_error ones */
+
 struct bar_dev {
   ulong             baseHdwr;
   ulong             baseLen;
   void*             reg;
 };
 
-#define MOD_SHARED 14
 #define OPEN_SHARES 256
 
 struct tpr_dev {
@@ -64,81 +156,127 @@ struct tpr_dev {
   struct cdev       cdev;
   struct fasync_struct* async_queue;
   int               irq;
+  int               node;           /* NUMA node of the card */
+  int               dmaCpu;         /* Preferred CPU for the interrupt and tasklet, -1 for any */
+  uint              holdoffUs;      /* Interrupt holdoff (sysfs irq_holdoff_us), irq_holdoff_us at probe */
   int               vmas;
-  void*             qmem;
+  struct page**     qpages;         /* Pages backing amem, mapped in full at mmap */
+  struct page**     cpages;         /* Pages backing cmem */
   void*             amem;           /* Page-aligned memory for the queues. */
+  void*             cmem;           /* Per-channel copy queues.  NULL unless enabled at load. */
+  struct page**     kpages;         /* Pages backing dmx.compact */
   struct bar_dev    bar[1];
+  uint              nchan;          /* Channels and triggers of the firmware, read at probe */
+  uint              ntrig;
   struct shared_tpr master;
   struct shared_tpr all_shares[OPEN_SHARES];
-  struct shared_tpr *shared[MOD_SHARED];  /* DLL per minor.  Used to wake waitq's and track when opening the first or closing the last. */
-  struct shared_tpr *bsa;                 /* DLL. Used to wake waitq's. */
+  struct list_head  shared[MAX_CHANNELS]; /* Subscribers per channel.  Used to wake waitq's and track when opening the first or closing the last. */
+  struct list_head  bsa;                  /* BSA subscribers.  Used to wake waitq's. */
   struct tasklet_struct dma_task;
   spinlock_t        lock;
-  struct shared_tpr *freelist;      /* SLL within all_shares. */
-  uint              minors;
-  uint              irqEnable;      /* Interrupt handling counters */
-  uint              irqDisable;
-  uint              irqCount;
-  uint              irqNoReq;
-  uint              dmaCount;      /* Count DMA messages */
-  uint              dmaEvent;
-  uint              dmaErrors;
-  uint              dmaBsaChan;
-  uint              dmaBsaCtrl;
-
-  // One list, two pointers into the list
-  // The list needs only to be singly-linked
-  struct RxBuffer** rxBuffer;
-  struct RxBuffer*  rxFree;
+  struct list_head  freelist;       /* Unused all_shares. */
+  u64               irqEnable;      /* Interrupt handling counters (sysfs stats/) */
+  u64               irqDisable;
+  u64               irqCount;
+  u64               irqNoReq;
+  u64               dmaIrqPass;     /* DMA passes started by an interrupt */
+  u64               dmaPollPass;    /* DMA passes rescheduled with the ring still busy */
+  u64               dmaHoldPass;    /* DMA passes started by the holdoff timer */
+  u64               dmaTimerPass;   /* DMA passes started by the coalescing timer */
+  int               dmaPolling;     /* TPR_POLL_* while the interrupt is left masked */
+  int               dmaStopping;    /* Set by tpr_remove: the tasklet arms no timer and does not reschedule */
+  struct hrtimer    holdoffTimer;   /* Next pass while the interrupt is held off (irq_holdoff_us) */
+  uint              zcReaders;      /* Zero-copy clients holding rx buffers */
+  u64               zcForced;       /* Rx buffers recycled before all readers released them */
+  u64               zcEpoch;        /* Epoch of the rx buffer being processed */
+  u64               zcFree;         /* Epoch of the oldest rx buffer not yet recycled */
+  spinlock_t        zcLock;
+  long long         wakewp[MAX_CHANNELS+1]; /* Write pointers at the last wakeup (BSA last) */
+  int               coalescers;     /* Opens with wakeup coalescing set */
+  int               filters;        /* Opens with an event filter */
+  struct timer_list coalesceTimer;  /* Flushes held wakeups when traffic stops */
+  struct delayed_work tscWork;      /* Refreshes the tsc calibration */
+  u64               irqStamp;       /* local_clock() of the interrupt that scheduled the tasklet */
+  u64               wakeStamp;      /* local_clock() when the tasklet started waking clients */
+  struct tpr_hist   histIrq;        /* Interrupt to tasklet start [ns] */
+  struct tpr_hist   histBuf;        /* Processing time per rx buffer [ns] */
+  struct tpr_hist   histMsgs;       /* Messages per rx buffer */
+  struct tpr_hist   histWake;       /* End of processing to each client wakeup [ns] */
+  struct dentry*    debugfs;
+  void*             flight;         /* Flight recorder ring of tpr_flight records, NULL unless enabled */
+  uint              flightCount;
+  uint              flightStride;
+  u64               flightSeq;      /* Rx buffers captured */
+  int               flightFrozen;   /* Freeze reason, 0 while recording */
+  u32               flightWord;     /* First word of the offending message */
+  u32               flightOffset;   /* and its byte offset in the last buffer captured */
+  u64               calTsc;         /* Last calibration point */
+  u64               calMono;
+
+  // Queue layout, fixed at probe (see struct TprQHeader).  The message
+  // counters, allq/bsaq and their indices are in dmx.
+  struct tpr_demux  dmx;
+  struct TprZcDesc* zcq;
+  struct TprZcDesc* zcbsaq;
+  uint              chnqMask;
+  ulong             shmSize;        /* Mapped at 0 */
+  ulong             chnqSize;       /* One channel's copy queue */
+  ulong             chnqOffset;
+  ulong             compactSize;    /* The compact ring */
+  ulong             compactOffset;
+  ulong             rxbufOffset;
+  ulong             filtOffset;
+  uint              filtMask;
+
+  // The rx buffers: one coherent pool, a dense ring of descriptors in the
+  // order they are given to the hardware, and pointers into the ring
+  struct pci_dev*   pcidev;
+  void*             rxPool;
+  dma_addr_t        rxPoolDma;
+  uint              rxCount;
+  uint              rxBufSize;
+  struct RxBuffer*  rxBuffer;
   struct RxBuffer*  rxPend;
+  struct RxBuffer*  rxHold;         /* Oldest buffer held for zero-copy readers */
 };
 
+// Why the interrupt is left masked after a dma pass
+#define TPR_POLL_BUDGET   1   /* dma_budget spent with buffers still done */
+#define TPR_POLL_HOLDOFF  2   /* irq_holdoff_us after a pass that found buffers */
+
 // Max number of devices to support
 #define MAX_PCI_DEVICES 8
 
 // Global Variable
 struct tpr_dev gDevices[MAX_PCI_DEVICES];
 
-#define MOD_MINORS (MOD_SHARED+2)
+/*
+ * Minors: channels 0..MOD_SHARED-1, control (MOD_SHARED), BSA (MOD_SHARED+1),
+ * then any channels from MOD_SHARED up on firmware with more of them.
+ */
+#define MOD_MINORS (MAX_CHANNELS+2)
+
+static inline int tpr_minor_channel(int minor)
+{
+  return minor < MOD_SHARED ? minor : minor >= MOD_SHARED+2 ? minor-2 : -1;
+}
 
-/* These must be powers of two!!! */
+/* Default queue depths (allq_depth, bsaq_depth, chnq_depth).  Powers of two!!! */
 #define MAX_TPR_ALLQ (32*1024)
-#define MAX_TPR_BSAQ  1024
-#define MSG_SIZE      32
+#define MAX_TPR_BSAQ  8192
+#define MAX_TPR_CHNQ (8*1024)
 
-// DMA Buffer Size, Bytes (could be as small as 512B)
+// DMA Buffer Size, Bytes (could be as small as 512B).  Default for rx_buf_size.
 #define BUF_SIZE 4096
+#define MAX_BUF_SIZE (1<<20)
+// Default and maximum for rx_buffers (the free FIFO holds 1023)
 #define NUMBER_OF_RX_BUFFERS 1023
+#define TPR_MIN_RX_BUFFERS 16
 
+// Channels and triggers assumed for firmware without the resources register
 #define RO_CHANNELS 14
 #define TR_CHANNELS 12
 
-struct TprEntry {
-  u32 word[MSG_SIZE];
-  u64 fifo_tsc;
-};
-
-struct TprQIndex {
-  long long idx[MAX_TPR_ALLQ];
-};
-
-//
-//  Maintain an indexed list into the tprq for each channel
-//  That way, applications of varied rates can jump to the next relevant entry
-//  Consider copying master queue to individual channel queues to reduce RT reqt
-//
-struct TprQueues {
-  struct TprEntry  allq  [MAX_TPR_ALLQ]; // master queue of shared messages
-  struct TprEntry  bsaq  [MAX_TPR_BSAQ]; // queue of BSA messages
-  struct TprQIndex allrp [MOD_SHARED];   // indices into allq
-  long long        allwp [MOD_SHARED];   // write pointer into allrp
-  long long        bsawp;                // write pointer into bsaq
-  long long        gwp;
-  int              fifofull;
-};
-
-#define TPR_SH_MEM_WINDOW   ((sizeof(struct TprQueues) + PAGE_SIZE) & PAGE_MASK)
-
 struct TprReg {
   volatile  __u32 reserved_0[0x10000>>2];
   volatile  __u32 FpgaVersion;
@@ -147,7 +285,14 @@ struct TprReg {
   volatile  __u32 reserved_40010[(0x20000>>2)-4];
   volatile  __u32 irqControl; // 0x60000
   volatile  __u32 irqStatus;
-  volatile  __u32 reserved_60008[0x3f8>>2];
+  volatile  __u32 partitionAddr;
+  volatile  __u32 dmaCount;         // RO 0x6000C (23:0 frames)
+  volatile  __u32 countReset;
+  volatile  __u32 trigMaster;
+  volatile  __u32 dmaFullThr;       // RW 0x60018 (9:0 fifo level that pauses dma)
+  volatile  __u32 dmaDrops;         // RO 0x6001C (23:0 frames dropped)
+  volatile  __u32 resources;        // RO 0x60020 (7:0 channels, 15:8 triggers), 0 on older firmware
+  volatile  __u32 reserved_60024[(0x3dc)>>2];
   //  PcieRxDesc   0x60400
   volatile  __u32 rxFree    [16];   // WO 0x400 Write Desc/Address
   volatile  __u32 rxFreeStat[16];   // RO 0x440 Free FIFO (31:31 full, 30:30 valid, 9:0 count)
@@ -170,7 +315,7 @@ struct TprReg {
 
 // Structure for RX buffers
 struct RxBuffer {
-  struct list_head lh;
   dma_addr_t  dma;
   unchar*     buffer;
+  uint        idx;
 };
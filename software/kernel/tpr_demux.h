@@ -0,0 +1,299 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'SLAC EVR Gen2', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  The dma demux core: parses one rx buffer, publishes its messages into
+//  allq/bsaq and maintains the per-channel and per-BSA-array indices.  It is
+//  plain C on top of tpr_queues.h so the same code is built into tpr.ko and
+//  into the userspace benchmark (app/tprbench.cc).
+//
+//  The includer defines these, after including this header:
+//
+//    tpr_demux_zc(d, bsa, pos, dptr, tsc, buf)
+//        Publish a zero-copy descriptor instead of an entry (d->zc set).
+//        buf is the caller's rx buffer, NULL for drop markers.
+//    tpr_demux_indexed(d, ich, pos, dptr, sz, tsc)
+//        Channel ich has indexed allq position pos (the message is at dptr,
+//        a DROP_TAG marker for drops).
+//    tpr_demux_message(d, pos, dptr, buf)
+//        The firmware message at dptr was published at allq (EVENT) or bsaq
+//        (BSA) position pos.
+//    tpr_demux_error(d, why, dptr, buf)
+//        The message at dptr is malformed; parsing of the buffer stops.
+//
+#ifndef TPR_DEMUX_H
+#define TPR_DEMUX_H
+
+#include "tpr_queues.h"
+
+#ifdef __KERNEL__
+static __u64 __rdtsc(void);    /* tpr.c */
+#else
+#include <string.h>
+#include <x86intrin.h>
+#define WRITE_ONCE(x, v)         __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_wmb()                __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_store_release(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define __ffs64(x)               __builtin_ctzll(x)
+#endif
+
+#define TPR_DEMUX_BADSIZE  1   /* tpr_demux_error reasons */
+#define TPR_DEMUX_BADTAG   2
+
+#define TPR_DEMUX_BSA_MASK (1u << MAX_CHANNELS)     /* Wake mask bit of the BSA stream */
+
+struct tpr_demux {
+  struct TprQueues* tprq;
+  struct TprEntry*  allq;           /* NULL with zc */
+  struct TprEntry*  bsaq;
+  struct TprCompact* compact;       /* Parallel to allq, NULL unless enabled */
+  long long*        allrp;          /* hdr.nchan index arrays of allqMask+1, NULL if index-free */
+  __u32*            allmask;        /* Tag word of each allq position if index-free, else NULL */
+  long long*        bsarp;          /* MOD_BSA index arrays of bsaqMask+1 */
+  __u32             allqMask;
+  __u32             bsaqMask;
+  __u32             chanMask;       /* Channels of the firmware (hdr.nchan) */
+  __u32             minors;         /* Channels with subscribers */
+  int               bsaOpen;        /* BSA has subscribers */
+  int               zc;             /* Publish through tpr_demux_zc */
+  __u64             dmaCount;       /* Count DMA messages */
+  __u64             dmaEvent;
+  __u64             dmaErrors;
+  __u64             dmaBsaChan;
+  __u64             dmaBsaCtrl;
+};
+
+static inline void tpr_demux_zc(struct tpr_demux* d, int bsa, long long pos,
+                                __u32* dptr, __u64 tsc, void* buf);
+static inline void tpr_demux_indexed(struct tpr_demux* d, unsigned ich, long long pos,
+                                     __u32* dptr, size_t sz, __u64 tsc);
+static inline void tpr_demux_message(struct tpr_demux* d, long long pos, __u32* dptr, void* buf);
+static inline void tpr_demux_error(struct tpr_demux* d, int why, __u32* dptr, void* buf);
+
+// Fill a queue entry following the publication protocol in tpr_queues.h
+static inline void tpr_entry_write(struct TprEntry* entry, long long pos,
+                                   __u32* dptr, size_t sz, __u64 tsc)
+{
+  WRITE_ONCE(entry->seq, TPR_SEQ_BUSY);
+  smp_wmb();
+  memcpy(entry->word, dptr, sz);
+  entry->fifo_tsc = tsc;
+  smp_store_release(&entry->seq, pos);
+}
+
+// Fill the compact record of an allq position (markers have no payload)
+static inline void tpr_compact_write(struct TprCompact* c, long long pos,
+                                     __u32* dptr, size_t sz, __u64 tsc)
+{
+  WRITE_ONCE(c->seq, ~(__u32)pos);
+  smp_wmb();
+  c->tag = dptr[0];
+  if (sz == EVENT_MSGSZ) {
+    c->pulseId   = dptr[EVENT_PULSEID_WORD]   | ((__u64)dptr[EVENT_PULSEID_WORD+1]   << 32);
+    c->timeStamp = dptr[EVENT_TIMESTAMP_WORD] | ((__u64)dptr[EVENT_TIMESTAMP_WORD+1] << 32);
+  }
+  else {
+    c->pulseId   = 0;
+    c->timeStamp = 0;
+  }
+  c->fifo_tsc = tsc;
+  smp_store_release(&c->seq, (__u32)pos);
+}
+
+// The index into allq for channel ich
+static inline long long* tpr_allrp(struct tpr_demux* d, unsigned ich)
+{
+  return d->allrp + (size_t)ich*(d->allqMask+1);
+}
+
+static inline long long* tpr_bsarp(struct tpr_demux* d, unsigned arr)
+{
+  return d->bsarp + (size_t)arr*(d->bsaqMask+1);
+}
+
+static inline __u64 tpr_bsa_mask(__u32* dptr, unsigned word)
+{
+  return dptr[word] | ((__u64)dptr[word+1] << 32);
+}
+
+// Index bsaq position pos into the stream of each BSA array in mask
+static inline void tpr_bsa_index(struct tpr_demux* d, long long pos, __u64 mask)
+{
+  struct TprQueues* tprq = d->tprq;
+  unsigned arr;
+
+  while (mask) {
+    arr  = __ffs64(mask);
+    mask &= mask-1;
+    tpr_bsarp(d, arr)[tprq->bsaiwp[arr] & d->bsaqMask] = pos;
+    smp_store_release(&tprq->bsaiwp[arr], tprq->bsaiwp[arr]+1);
+  }
+}
+
+// Publish a message (or marker) at the next position of allq, or of bsaq
+static inline long long tpr_demux_publish(struct tpr_demux* d, int bsa, __u32* dptr,
+                                          size_t sz, __u64 tsc, void* buf)
+{
+  long long pos = bsa ? d->tprq->bsawp : d->tprq->gwp;
+
+  if (d->zc)
+    tpr_demux_zc(d, bsa, pos, dptr, tsc, buf);
+  else if (bsa)
+    tpr_entry_write(&d->bsaq[pos & d->bsaqMask], pos, dptr, sz, tsc);
+  else
+    tpr_entry_write(&d->allq[pos & d->allqMask], pos, dptr, sz, tsc);
+  if (d->compact && !bsa)
+    tpr_compact_write(&d->compact[pos & d->allqMask], pos, dptr, sz, tsc);
+  return pos;
+}
+
+// Index allq position pos for each channel in mch, counting it as an entry
+// or as a drop.  Index-free, only the tag word is stored (one sequential
+// store in place of an index slot and write pointer per channel); drops are
+// still counted, entries are not.
+static inline void tpr_demux_channels(struct tpr_demux* d, __u32 mch, long long pos,
+                                      __u32* dptr, size_t sz, __u64 tsc, int drop)
+{
+  struct TprQueues* tprq = d->tprq;
+  unsigned ich;
+
+  if (d->allmask) {
+    WRITE_ONCE(d->allmask[pos & d->allqMask], dptr[0]);
+    while (drop && mch) {
+      tprq->chstat[__ffs64(mch)].drops++;
+      mch &= mch-1;
+    }
+    return;
+  }
+
+  while (mch) {
+    ich = __ffs64(mch);
+    mch &= mch-1;
+    if (drop)
+      tprq->chstat[ich].drops++;
+    else
+      tprq->chstat[ich].entries++;
+    tpr_allrp(d, ich)[tprq->allwp[ich] & d->allqMask] = pos;
+    smp_store_release(&tprq->allwp[ich], tprq->allwp[ich]+1);
+    tpr_demux_indexed(d, ich, pos, dptr, sz, tsc);
+  }
+}
+
+// Account for a firmware drop and mark it in the stream of every open channel
+// and in the BSA queue.  Returns the mask of streams that were marked.
+// The marker fills the whole entry, so that no word of the message that had
+// the slot a lap earlier (its pulse id, say) shows through.
+static inline __u32 tpr_demux_drop(struct tpr_demux* d, __u64 tsc)
+{
+  struct TprQueues* tprq = d->tprq;
+  __u32 mch, marker[MSG_SIZE] = {0};
+  long long pos;
+
+  tprq->fifofull = 1;
+
+  mch = d->minors & d->chanMask;
+  marker[0] = (DROP_TAG<<16) | mch;
+  marker[1] = mch;
+
+  if (mch) {
+    pos = tpr_demux_publish(d, 0, marker, sizeof(marker), tsc, NULL);
+    tpr_demux_channels(d, mch, pos, marker, sizeof(marker), tsc, 1);
+    smp_store_release(&tprq->gwp, pos+1);
+  }
+
+  if (d->bsaOpen) {
+    tprq->bsastat.drops++;
+    pos = tpr_demux_publish(d, 1, marker, sizeof(marker), tsc, NULL);
+    tpr_bsa_index(d, pos, ~0ULL);
+    smp_store_release(&tprq->bsawp, pos+1);
+    mch |= TPR_DEMUX_BSA_MASK;
+  }
+
+  return mch;
+}
+
+// Parse the messages of one rx buffer up to its END_TAG.  Returns the mask
+// of streams with new entries (TPR_DEMUX_BSA_MASK for BSA) and the number of
+// messages in *nmsg.
+static inline __u32 tpr_demux_buffer(struct tpr_demux* d, __u32* dptr, void* buf, unsigned* nmsg)
+{
+  struct TprQueues* tprq = d->tprq;
+  __u32 mtyp, mch, ich, wmask = 0;
+  __u64 tsc;
+  long long pos;
+
+  *nmsg = 0;
+
+  while( ((dptr[0]>>16)&0xf) != END_TAG ) {
+
+    d->dmaCount++;
+    (*nmsg)++;
+    tsc = __rdtsc();
+
+    //  Check if a drop preceded us
+    if ( dptr[0] & (0x808<<20))
+      wmask = wmask | tpr_demux_drop(d, tsc);
+
+    //  Check the message type
+    mtyp = (dptr[0]>>16)&0xf;
+    switch (mtyp) {
+    case BSACNTL_TAG:
+      d->dmaBsaCtrl++;
+      tprq->bsastat.entries++;
+      wmask = wmask | TPR_DEMUX_BSA_MASK;
+      pos = tpr_demux_publish(d, 1, dptr, BSACNTL_MSGSZ, tsc, buf);
+      tpr_bsa_index(d, pos, tpr_bsa_mask(dptr, BSACNTL_INIT_WORD));
+      smp_store_release(&tprq->bsawp, pos+1);
+      tpr_demux_message(d, pos, dptr, buf);
+      dptr += BSACNTL_MSGSZ>>2;
+      break;
+    case BSAEVNT_TAG:
+      d->dmaBsaChan++;
+      tprq->bsastat.entries++;
+      wmask = wmask | TPR_DEMUX_BSA_MASK;
+      pos = tpr_demux_publish(d, 1, dptr, BSAEVNT_MSGSZ, tsc, buf);
+      tpr_bsa_index(d, pos,
+                    tpr_bsa_mask(dptr, BSAEVNT_ACTIVE_WORD) |
+                    tpr_bsa_mask(dptr, BSAEVNT_AVGDONE_WORD) |
+                    tpr_bsa_mask(dptr, BSAEVNT_DONE_WORD));
+      smp_store_release(&tprq->bsawp, pos+1);
+      tpr_demux_message(d, pos, dptr, buf);
+      dptr += BSAEVNT_MSGSZ>>2;
+      break;
+    case EVENT_TAG:
+      d->dmaEvent++;
+      mch = (dptr[0]>>0)&d->chanMask;
+      if (((dptr[1]<<2)+8)!=EVENT_MSGSZ) {
+        tpr_demux_error(d, TPR_DEMUX_BADSIZE, dptr, buf);
+        d->dmaErrors++;
+        for( ich=0; ich<MAX_CHANNELS; ich++)
+          if (mch & (1<<ich))
+            tprq->chstat[ich].dmaErrors++;
+
+        dptr[0] = END_TAG << 16;  // terminate
+        break;
+      }
+      pos = tpr_demux_publish(d, 0, dptr, EVENT_MSGSZ, tsc, buf);
+      wmask = wmask | mch;
+      tpr_demux_channels(d, mch, pos, dptr, EVENT_MSGSZ, tsc, 0);
+      smp_store_release(&tprq->gwp, pos+1);
+      tpr_demux_message(d, pos, dptr, buf);
+      dptr += EVENT_MSGSZ>>2;
+      break;
+    default:
+      tpr_demux_error(d, TPR_DEMUX_BADTAG, dptr, buf);
+      dptr[0] = END_TAG << 16;  // terminate
+      break;
+    }
+  }
+
+  return wmask;
+}
+
+#endif
@@ -0,0 +1,240 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the 
+// top-level directory of this distribution and at: 
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html. 
+// No part of 'SLAC EVR Gen2', including this file, 
+// may be copied, modified, propagated, or distributed except according to 
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Message formats and the layout of the queues the driver publishes.
+//  Shared by the driver and userspace builds of the demux core (tpr_demux.h),
+//  so nothing here may depend on kernel headers beyond the basic types.
+//
+#ifndef TPR_QUEUES_H
+#define TPR_QUEUES_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+typedef uint8_t  u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t  s32;
+typedef int64_t  s64;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+#endif
+
+// TPR message tags
+#define EVENT_TAG    0
+#define BSACNTL_TAG  1
+#define BSAEVNT_TAG  2
+#define DROP_TAG    14    /* Written by the driver: firmware dropped messages before this point */
+#define END_TAG     15
+
+#define EVENT_MSGSZ    92
+
+// EVENT payload words (the timing message follows the two header words)
+#define EVENT_PULSEID_WORD  2   // 64-bit pulse id
+#define EVENT_TIMESTAMP_WORD 4  // 64-bit timestamp: seconds 63:32, nanoseconds 31:0
+#define EVENT_BEAMREQ_WORD  7   // beam request: bit 0 beam, 7:4 destination
+#define BSACNTL_MSGSZ  44
+#define BSAEVNT_MSGSZ  44
+
+// BSA payload words (64-bit masks, one bit per BSA array)
+#define BSACNTL_INIT_WORD     5   // arrays (re)initialized; active and avgDone follow as subsets
+#define BSAEVNT_ACTIVE_WORD   3
+#define BSAEVNT_AVGDONE_WORD  5
+#define BSAEVNT_DONE_WORD     9   // arrays updated
+#define MOD_BSA              64   // BSA arrays
+
+#define MOD_SHARED   14   // control minor; channels below it keep their minor
+#define MAX_CHANNELS 16   // channel streams (the firmware's dma channel mask is 16 bits)
+#define MSG_SIZE     32
+
+struct TprEntry {
+  u32 word[MSG_SIZE];
+  u64 fifo_tsc;
+  s64 seq;        // queue position of this entry, TPR_SEQ_BUSY while it is rewritten
+};
+
+#define TPR_SEQ_BUSY  (-1LL)
+
+//
+//  Per-channel accounting, visible in the mapped queues
+//  Reset when the channel (or BSA) is opened by its first client.
+//
+struct TprChStats {
+  long long drops;      // firmware drop flags seen while the channel was open
+  long long dmaErrors;  // events for this channel discarded on a bad dma size
+  long long entries;    // entries indexed for this channel
+};
+
+//
+//  Zero-copy descriptor (zero_copy=1)
+//  The message stays in rx buffer 'buf', mapped read-only at hdr.rxbufOffset.
+//  The data is valid as long as zcfree <= epoch after it has been read.
+//
+struct TprZcDesc {
+  u32 buf;        // index of the rx buffer holding the message
+  u32 offset;     // byte offset of the message in the buffer
+  u32 tag;        // first word of the message (tag, flags, channel mask)
+  u32 reserved;
+  u64 epoch;      // sequence number of the rx buffer
+  u64 fifo_tsc;
+  s64 seq;        // as TprEntry
+};
+
+//
+//  Compact summary of an allq position (compact_queue=1), one half cache line
+//  for clients that need no more than this.  The ring parallels allq: the
+//  slot of position pos is pos & (allqDepth-1), so allrp indexes it as well,
+//  and it is filled with zero_copy too.  seq is the low 32 bits of pos, and
+//  ~pos while the slot is rewritten; that never equals a position sharing the
+//  slot, so it is checked like TprEntry.seq.  Drop markers have the DROP_TAG
+//  tag word and zero pulseId and timeStamp.
+//
+struct TprCompact {
+  u64 pulseId;
+  u64 timeStamp;
+  u32 tag;        // first word of the message (tag, drop flags, channel mask)
+  u32 seq;
+  u64 fifo_tsc;
+};
+
+//
+//  Maintain an indexed list into the tprq for each channel
+//  That way, applications of varied rates can jump to the next relevant entry
+//  Consider copying master queue to individual channel queues to reduce RT reqt
+//
+//  Publication protocol (single writer, the dma tasklet):
+//    entry:  seq = TPR_SEQ_BUSY; wmb; payload; store-release seq = position
+//    index:  idx[] slot, then store-release of the write pointer (allwp, gwp,
+//            bsawp, chnwp)
+//  A reader load-acquires the write pointer, load-acquires seq and checks it
+//  equals the position it expects, copies the payload, issues a read barrier
+//  and checks seq again.  Any mismatch means the writer lapped the reader.
+//  An allrp index slot is only trustworthy while allwp - rp < hdr.allqDepth,
+//  checked after the entry has been copied.
+//
+//  Resume rule: a reader at rp that finds itself lapped (wp - rp >= depth)
+//  resumes at wp - depth + 1, the oldest slot still good, and counts the
+//  positions skipped as lost.  One whose entry was rewritten under a good
+//  index slot (allq wraps ahead of a sparse channel) skips just that entry.
+//  read() in TPR_READ_ENTRIES mode and the readers of tprsh.hh all do this,
+//  so both report the same losses.
+//
+//  The BSA queue is indexed the same way per BSA array: bsarp[arr] lists
+//  the bsaq positions of the messages whose masks have bit arr set (init
+//  for BSACNTL; active, avgDone or done for BSAEVNT), with write pointer
+//  bsaiwp[arr].  Drop markers are indexed into every array.
+//
+//  With index_free there are no allrp indices or allwp write pointers, and
+//  chstat counts drops only.  Instead allmask[pos & (allqDepth-1)] holds the
+//  first word of the message at pos (channel mask in bits 15:0), stored
+//  before gwp is released.  A channel's reader scans allmask from its
+//  position up to gwp for its bit, checks seq on each entry it copies, and
+//  is lapped once gwp - rp >= hdr.allqDepth.
+//
+//  When the firmware flags a drop, a DROP_TAG entry (word[1] holds the mask
+//  of channels it was indexed into) is put in every open channel's stream
+//  and in the BSA queue, ahead of the message that carried the flag.
+//
+//  The queue depths are set at module load, so the mapping starts with a
+//  header describing where everything is.  Userspace must check magic,
+//  version and the structure sizes before using any of it.  A queue that is
+//  not in use (allq/bsaq with zero_copy, zcq/zcbsaq without) has offset 0.
+//
+#define TPR_Q_MAGIC    0x51525054   /* "TPRQ" */
+#define TPR_Q_VERSION  8
+
+struct TprQHeader {
+  u32 magic;
+  u32 version;
+  u32 hdrSize;          // sizeof(struct TprQueues)
+  u32 entrySize;        // sizeof(struct TprEntry)
+  u32 zcDescSize;       // sizeof(struct TprZcDesc)
+  u32 nchan;            // channels of this firmware (<= MAX_CHANNELS), each with an allrp stream
+  u32 allqDepth;        // entries in allq, zcq and each allrp index
+  u32 bsaqDepth;        // entries in bsaq, zcbsaq
+  u32 chnqDepth;        // entries in each channel copy queue, 0 if none
+  u32 rxBuffers;        // rx buffers mapped at rxbufOffset, 0 unless zero_copy
+  u32 rxBufSize;
+  s32 node;             // NUMA node of the card, holding the queues and rx buffers (-1 if unknown)
+  u64 allqOffset;       // byte offsets into the mapping at 0
+  u64 bsaqOffset;
+  u64 allrpOffset;      // nchan index arrays of allqDepth long longs
+  u64 zcqOffset;
+  u64 zcbsaqOffset;
+  u64 shmSize;          // bytes mappable at offset 0
+  u64 chnqOffset;       // mmap offset of a channel's own copy queue, 0 if none
+  u64 chnqSize;         // bytes mappable there
+  u64 rxbufOffset;      // mmap offset of the rx buffers, 0 unless zero_copy
+  u64 filtOffset;       // mmap offset of an open's filtered index (TPR_IOC_FILTER)
+  u32 filtDepth;        // entries in the filtered index
+  u32 nbsa;             // BSA array index streams (MOD_BSA)
+  u64 bsarpOffset;      // nbsa index arrays of bsaqDepth long longs
+  u32 ntrig;            // trigger outputs of this firmware
+  u32 compactEntrySize; // sizeof(struct TprCompact)
+  u64 compactOffset;    // mmap offset of the compact ring, 0 unless compact_queue
+  u64 compactSize;      // bytes mappable there (allqDepth records)
+  u64 allmaskOffset;    // allqDepth tag words, in place of allrp (index_free), 0 otherwise
+};
+
+//
+//  Conversion of fifo_tsc to clock time, refreshed every tsc_cal_ms
+//    mono = this.mono + (((tsc - this.tsc) * mult) >> shift)     [ns]
+//    tai  = mono + taiOffset
+//  Read like a seqcount: retry while gen is odd or changes across the read.
+//  The rate is measured against CLOCK_MONOTONIC between refreshes, so it
+//  follows NTP slewing.
+//
+#define TPR_TSC_SHIFT 24
+
+struct TprTscCal {
+  u32 gen;
+  u32 shift;
+  u64 mult;
+  u64 tsc;              // tsc at the calibration point
+  u64 mono;             // CLOCK_MONOTONIC at the calibration point [ns]
+  s64 taiOffset;        // CLOCK_TAI - CLOCK_MONOTONIC [ns]
+};
+
+struct TprQueues {
+  struct TprQHeader hdr;
+  struct TprTscCal  tsccal;
+  long long        allwp [MAX_CHANNELS]; // write pointer into allrp
+  long long        bsawp;                // write pointer into bsaq
+  long long        gwp;
+  int              fifofull;
+  long long        zcfree;               // rx buffers below this epoch are back with the hardware
+  struct TprChStats chstat[MAX_CHANNELS]; // per-channel drop/error accounting
+  struct TprChStats bsastat;
+  long long        bsaiwp[MOD_BSA];      // write pointer into each bsarp
+};
+
+//
+//  Optional private copy of the master queue for each channel (chan_queues=1)
+//  A channel's consumer maps its own queue at hdr.chnqOffset and walks it
+//  densely, without the allrp indirection.
+//
+struct TprChQueue {
+  long long        chnwp;                // write pointer into chnq
+  long long        reserved[7];
+  struct TprEntry  chnq  [];             // hdr.chnqDepth copies of this channel's messages
+};
+
+//
+//  Filtered index of one open (TPR_IOC_FILTER), mapped at hdr.filtOffset
+//  from that file descriptor.  Read like allrp/allwp.
+//
+struct TprFiltQueue {
+  long long        fwp;                  // write pointer into fidx
+  long long        reserved[7];
+  long long        fidx[];               // hdr.filtDepth positions in allq
+};
+
+#endif
@@ -0,0 +1,185 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'SLAC EVR Gen2'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'SLAC EVR Gen2', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Static tracepoints of the interrupt and dma paths, for perf / trace-cmd:
+//
+//    trace-cmd record -e tpr -e irq -e sched_switch ...
+//    perf record -e 'tpr:*' -a ...
+//
+//  Every event carries the card (its index in gDevices), the allq write
+//  pointer gwp, and the rx buffer involved (the next one to be processed
+//  where no buffer is in hand).  Disabled, each costs a patched-out branch.
+//  Included by tpr.c after tpr.h, once with CREATE_TRACE_POINTS.
+//
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tpr
+
+#if !defined(_TPR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TPR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define tpr_trace_gwp(dev)  (((struct TprQueues*)(dev)->amem)->gwp)
+
+// Interrupt handler entry and exit
+TRACE_EVENT(tpr_irq_entry,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb, u32 stat),
+  TP_ARGS(dev, rxb, stat),
+  TP_STRUCT__entry(
+    __field(u32,         card)
+    __field(s64,         gwp)
+    __field(const void*, buf)
+    __field(u32,         stat)
+  ),
+  TP_fast_assign(
+    __entry->card = dev - gDevices;
+    __entry->gwp  = tpr_trace_gwp(dev);
+    __entry->buf  = rxb->buffer;
+    __entry->stat = stat;
+  ),
+  TP_printk("card=%u gwp=%lld buf=%p stat=%#x",
+            __entry->card, __entry->gwp, __entry->buf, __entry->stat)
+);
+
+TRACE_EVENT(tpr_irq_exit,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb, int handled),
+  TP_ARGS(dev, rxb, handled),
+  TP_STRUCT__entry(
+    __field(u32,         card)
+    __field(s64,         gwp)
+    __field(const void*, buf)
+    __field(int,         handled)
+  ),
+  TP_fast_assign(
+    __entry->card    = dev - gDevices;
+    __entry->gwp     = tpr_trace_gwp(dev);
+    __entry->buf     = rxb->buffer;
+    __entry->handled = handled;
+  ),
+  TP_printk("card=%u gwp=%lld buf=%p handled=%d",
+            __entry->card, __entry->gwp, __entry->buf, __entry->handled)
+);
+
+// One rx buffer through the demux (nmsg is 0 at the start)
+DECLARE_EVENT_CLASS(tpr_buf,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb, unsigned nmsg),
+  TP_ARGS(dev, rxb, nmsg),
+  TP_STRUCT__entry(
+    __field(u32,         card)
+    __field(s64,         gwp)
+    __field(const void*, buf)
+    __field(u32,         idx)
+    __field(u32,         nmsg)
+  ),
+  TP_fast_assign(
+    __entry->card = dev - gDevices;
+    __entry->gwp  = tpr_trace_gwp(dev);
+    __entry->buf  = rxb->buffer;
+    __entry->idx  = rxb->idx;
+    __entry->nmsg = nmsg;
+  ),
+  TP_printk("card=%u gwp=%lld buf=%p idx=%u nmsg=%u",
+            __entry->card, __entry->gwp, __entry->buf, __entry->idx, __entry->nmsg)
+);
+
+DEFINE_EVENT(tpr_buf, tpr_buf_start,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb, unsigned nmsg),
+  TP_ARGS(dev, rxb, nmsg));
+
+DEFINE_EVENT(tpr_buf, tpr_buf_end,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb, unsigned nmsg),
+  TP_ARGS(dev, rxb, nmsg));
+
+// Each message published; pos is its allq (EVENT) or bsaq (BSA) position.
+// Filter on type to follow one kind.
+TRACE_EVENT(tpr_msg,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb, __u32 *dptr, long long pos),
+  TP_ARGS(dev, rxb, dptr, pos),
+  TP_STRUCT__entry(
+    __field(u32,         card)
+    __field(s64,         gwp)
+    __field(const void*, buf)
+    __field(u32,         offset)
+    __field(u32,         type)
+    __field(u32,         word)
+    __field(s64,         pos)
+  ),
+  TP_fast_assign(
+    __entry->card   = dev - gDevices;
+    __entry->gwp    = tpr_trace_gwp(dev);
+    __entry->buf    = rxb->buffer;
+    __entry->offset = (unchar*)dptr - rxb->buffer;
+    __entry->type   = (dptr[0]>>16)&0xf;
+    __entry->word   = dptr[0];
+    __entry->pos    = pos;
+  ),
+  TP_printk("card=%u gwp=%lld buf=%p offset=%u type=%s word=%#x pos=%lld",
+            __entry->card, __entry->gwp, __entry->buf, __entry->offset,
+            __print_symbolic(__entry->type,
+                             { EVENT_TAG,   "event"   },
+                             { BSACNTL_TAG, "bsacntl" },
+                             { BSAEVNT_TAG, "bsaevnt" }),
+            __entry->word, __entry->pos)
+);
+
+// An rx buffer handed back to the firmware
+TRACE_EVENT(tpr_rx_free,
+  TP_PROTO(struct tpr_dev *dev, struct RxBuffer *rxb),
+  TP_ARGS(dev, rxb),
+  TP_STRUCT__entry(
+    __field(u32,         card)
+    __field(s64,         gwp)
+    __field(const void*, buf)
+    __field(u32,         idx)
+    __field(u64,         dma)
+  ),
+  TP_fast_assign(
+    __entry->card = dev - gDevices;
+    __entry->gwp  = tpr_trace_gwp(dev);
+    __entry->buf  = rxb->buffer;
+    __entry->idx  = rxb->idx;
+    __entry->dma  = rxb->dma;
+  ),
+  TP_printk("card=%u gwp=%lld buf=%p idx=%u dma=%#llx",
+            __entry->card, __entry->gwp, __entry->buf, __entry->idx, __entry->dma)
+);
+
+// A subscriber woken with count new entries (minor -1 for BSA)
+TRACE_EVENT(tpr_wake,
+  TP_PROTO(struct shared_tpr *shared, __u64 count),
+  TP_ARGS(shared, count),
+  TP_STRUCT__entry(
+    __field(u32,         card)
+    __field(s64,         gwp)
+    __field(const void*, buf)
+    __field(int,         minor)
+    __field(int,         open)
+    __field(u64,         count)
+  ),
+  TP_fast_assign(
+    __entry->card  = shared->parent - gDevices;
+    __entry->gwp   = tpr_trace_gwp(shared->parent);
+    __entry->buf   = shared->parent->rxPend->buffer;
+    __entry->minor = shared->minor;
+    __entry->open  = shared->idx;
+    __entry->count = count;
+  ),
+  TP_printk("card=%u gwp=%lld buf=%p minor=%d open=%d count=%llu",
+            __entry->card, __entry->gwp, __entry->buf, __entry->minor,
+            __entry->open, __entry->count)
+);
+
+#endif /* _TPR_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tpr_trace
+#include <trace/define_trace.h>